@@ -0,0 +1,166 @@
+#include <avr/interrupt.h>
+#include <avr/io.h>
+
+#include "adc.h"
+#include "capture.h"
+#include "queue.h"
+#include "task.h"
+
+#define ADC_FWD 6
+#define ADC_REV 7
+
+// Allow a few ticks on top of the time an acquisition should take.
+#define ADC_TIMEOUT_MS 10
+
+// Quiet mode is never set without ADC Noise Reduction sleep.
+#if !TASK_SLEEP_ADC
+#define task_sleep_adc(on)
+#endif
+
+// Queue of tasks waiting for an acquisition to complete.
+static QUEUE _adc__waiters;
+
+// Set while an acquisition is in progress.
+static volatile uint8_t _adc__acquiring;
+
+// Pair of the last acquisition.
+static struct adc_pair _adc__pair;
+
+// Oversampling of the current acquisition (see adc_acquire).
+static uint8_t _adc__k;
+
+// Set to convert in ADC Noise Reduction sleep (see adc_set_quiet).
+static uint8_t _adc__quiet;
+
+// Conversions per input left for the pair.
+static uint16_t _adc__left;
+
+// Input of the conversion that completes next.
+static uint8_t _adc__input;
+
+// Sums of the conversions for the pair.
+static uint32_t _adc__fwd;
+static uint32_t _adc__rev;
+
+ISR(ADC_vect) {
+  uint16_t v = ADC;
+  uint8_t input = _adc__input;
+
+  uint8_t next = input ^ (ADC_FWD ^ ADC_REV);
+
+  // In free running mode, the conversion that started when this one
+  // completed uses the other input; select this input again for the one
+  // after that. Otherwise the next conversion starts when the scheduler
+  // goes to sleep.
+  ADMUX = _BV(REFS0) | (_adc__quiet ? next : input);
+  _adc__input = next;
+
+  // Ignore what completes after a timeout.
+  if (!_adc__acquiring) {
+    return;
+  }
+
+  capture_sample_from_isr(input, v);
+
+  if (input == ADC_FWD) {
+    _adc__fwd += v;
+
+    // The conversion that is running now completes the pair.
+    if (_adc__left == 1) {
+      ADCSRA &= ~_BV(ADATE);
+    }
+    return;
+  }
+
+  _adc__rev += v;
+  if (--_adc__left > 0) {
+    return;
+  }
+
+  // Decimate: the sum of 4^k conversions has k more significant bits.
+  _adc__pair.fwd = _adc__fwd >> _adc__k;
+  _adc__pair.rev = _adc__rev >> _adc__k;
+  _adc__acquiring = 0;
+  task_sleep_adc(0);
+
+  // Switch to the waiting task on return, instead of when the interrupted
+  // task next yields or at the next tick.
+  task_wake_one_from_isr(&_adc__waiters);
+}
+
+void adc_init(void) {
+  QUEUE_INIT(&_adc__waiters);
+
+  // ADC Enable.
+  ADCSRA = _BV(ADEN);
+
+  // Prescaler at 128 to turn 16 MHz into 125 KHz.
+  ADCSRA |= _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+
+  // Auto trigger source is the ADC itself (free running).
+  ADCSRB = 0;
+
+  // Ports ADC6 and ADC7 are inputs.
+  DDRF &= ~_BV(DDF7);
+  DDRF &= ~_BV(DDF6);
+  PORTF &= ~_BV(PF7);
+  PORTF &= ~_BV(PF6);
+}
+
+uint8_t adc_acquire(uint8_t k, struct adc_pair *p) {
+  uint8_t sreg = SREG;
+  uint16_t timeout;
+  uint8_t ok;
+
+  // Let a conversion that ran past a timeout complete.
+  while (ADCSRA & _BV(ADSC)) {
+  }
+
+  if (k > ADC_OVERSAMPLE_MAX) {
+    k = ADC_OVERSAMPLE_MAX;
+  }
+
+  // A pair takes 2 * 4^k conversions of 104us, which is less than 4^k / 4 ms.
+  timeout = ADC_TIMEOUT_MS + ((1 << (2 * k)) >> 2);
+
+  // Interrupts are disabled until this task is on the wait queue.
+  cli();
+  _adc__acquiring = 1;
+  _adc__k = k;
+  _adc__left = 1 << (2 * k);
+  _adc__fwd = 0;
+  _adc__rev = 0;
+  _adc__input = ADC_FWD;
+
+  ADMUX = _BV(REFS0) | ADC_FWD;
+  if (_adc__quiet) {
+    // Every time the scheduler goes to sleep, it starts a conversion.
+    ADCSRA |= _BV(ADIE) | _BV(ADIF);
+    task_sleep_adc(1);
+  } else {
+    // Start with the forward input, then select the reverse input for the
+    // second conversion, which starts as soon as the first completes.
+    ADCSRA |= _BV(ADSC) | _BV(ADATE) | _BV(ADIE) | _BV(ADIF);
+    ADMUX = _BV(REFS0) | ADC_REV;
+  }
+
+  ok = task_wait(&_adc__waiters, timeout);
+  if (ok) {
+    *p = _adc__pair;
+  } else {
+    _adc__acquiring = 0;
+    ADCSRA &= ~_BV(ADATE);
+    task_sleep_adc(0);
+    p->fwd = 0;
+    p->rev = 0;
+  }
+
+  SREG = sreg;
+  return ok;
+}
+
+void adc_set_quiet(uint8_t quiet) {
+#if TASK_SLEEP_ADC
+  _adc__quiet = quiet;
+#endif
+}
@@ -0,0 +1,52 @@
+#ifndef _ADC_H
+#define _ADC_H
+
+#include <stdint.h>
+
+/*
+ * Acquisition of forward and reverse detector readings.
+ *
+ * Forward power on channel A1 (ADC6)
+ * Reverse power on channel A0 (ADC7)
+ *
+ * The ADC runs in free running mode for as long as it takes to acquire a
+ * forward/reverse pair. Its interrupt handler alternates between both inputs
+ * and sums their conversions. The task that asked for the pair is woken up
+ * once, when it is complete.
+ *
+ * A pair can be the sum of 4^k conversions of each input, decimated to
+ * 10 + k bits. This only adds resolution if the inputs are noisy by about a
+ * count or more, which spreads the conversions over neighbouring counts.
+ *
+ * In quiet mode (see adc_set_quiet), the ADC converts one input at a time
+ * while the processor sleeps in ADC Noise Reduction mode, away from the
+ * noise of the CPU and I/O clocks. A conversion only starts when no task is
+ * runnable, so other tasks delay the acquisition.
+ *
+ * A conversion takes 104us. Once converting, the ADC selects the input of
+ * the next conversion when the current one completes, so in free running
+ * mode the handler has to run within one conversion of the previous one to
+ * keep the inputs apart.
+ */
+
+// Maximum oversampling: 256 conversions per input and pair, 14 bits.
+#define ADC_OVERSAMPLE_MAX 4
+
+struct adc_pair {
+  uint16_t fwd;
+  uint16_t rev;
+};
+
+// Configure ADC and its inputs.
+void adc_init(void);
+
+// Acquire a pair of 10 + k bits (4^k conversions per input) and wait until
+// it is in. Returns 0 with a pair of zeroes if the ADC doesn't complete in
+// time.
+uint8_t adc_acquire(uint8_t k, struct adc_pair *p);
+
+// Convert in ADC Noise Reduction sleep from the next acquisition on if set.
+// Needs TASK_SLEEP_ADC; without it, the ADC always runs freely.
+void adc_set_quiet(uint8_t quiet);
+
+#endif
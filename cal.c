@@ -0,0 +1,204 @@
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+
+#include "cal.h"
+#include "measure.h"
+
+// Written last, so an interrupted calibration is never used.
+#define CAL_MAGIC 0xc5
+
+// Gains are in 4.12 fixed point.
+#define CAL_GAIN_ONE 4096
+
+struct cal_point {
+  // |Γ|^2 read for a perfect match, in 1/65536ths.
+  uint16_t offset;
+
+  // 1 / (|Γ|^2 read for a full reflection - offset). While calibrating,
+  // |Γ|^2 read for the open and then the mean of open and short.
+  uint16_t gain;
+};
+
+static struct cal_point _cal__table[CAL_BANDS][CAL_POINTS] EEMEM;
+static uint8_t _cal__magic EEMEM;
+
+// 128 * sqrt(m) for m at every 512 in [2^14, 2^16].
+static const uint16_t _cal__sqrt[97] PROGMEM = {
+  16384, 16638, 16888, 17135, 17378, 17618, 17854, 18087,
+  18318, 18545, 18770, 18992, 19212, 19429, 19644, 19856,
+  20066, 20274, 20480, 20684, 20886, 21085, 21283, 21480,
+  21674, 21867, 22058, 22247, 22435, 22621, 22806, 22989,
+  23170, 23351, 23530, 23707, 23884, 24059, 24232, 24405,
+  24576, 24746, 24915, 25083, 25249, 25415, 25580, 25743,
+  25905, 26067, 26227, 26387, 26545, 26703, 26859, 27015,
+  27170, 27324, 27477, 27629, 27780, 27931, 28081, 28230,
+  28378, 28525, 28672, 28818, 28963, 29108, 29251, 29394,
+  29537, 29678, 29819, 29960, 30099, 30238, 30377, 30515,
+  30652, 30788, 30924, 31059, 31194, 31328, 31462, 31595,
+  31727, 31859, 31991, 32122, 32252, 32382, 32511, 32640,
+  32768,
+};
+
+// Selected band.
+static uint8_t _cal__band;
+static uint8_t _cal__valid;
+static uint32_t _cal__fa;
+static uint32_t _cal__span;
+
+// Turns an offset from fa into a point index with 8 fractional bits, by
+// multiplying and shifting right by 19.
+static uint32_t _cal__scale;
+
+// Correction for the last frequency set.
+static uint16_t _cal__offset = 0;
+static uint16_t _cal__gain = CAL_GAIN_ONE;
+
+// Return |Γ|^2 of a pair in 1/65536ths.
+static uint16_t cal__square(const struct adc_pair *p) {
+  uint16_t gamma = measure_gamma(p);
+
+  return ((uint32_t)gamma * gamma) >> 16;
+}
+
+// Return the square root of x / 2^16 in 1/65536ths.
+static uint16_t cal__sqrt(uint16_t x) {
+  uint8_t s = 0;
+  uint8_t i;
+  uint16_t lo;
+  uint16_t hi;
+
+  if (x == 0) {
+    return 0;
+  }
+
+  // Shift x into [2^14, 2^16) by an even number of bits, which shifts the
+  // root by half as many.
+  while (x < 0x4000) {
+    x <<= 2;
+    s++;
+  }
+
+  // Interpolate with the 9 bits below the index.
+  i = (x >> 9) - 32;
+  lo = pgm_read_word(&_cal__sqrt[i]);
+  hi = pgm_read_word(&_cal__sqrt[i + 1]);
+  lo += ((uint32_t)(hi - lo) * (x & 0x1ff)) >> 9;
+
+  // 2^8 sqrt(x) is 2 * 128 sqrt(x).
+  return ((uint32_t)lo << 1) >> s;
+}
+
+uint32_t cal_point_hz(uint32_t fa, uint32_t fb, uint8_t i) {
+  return fa + ((fb - fa) * i) / (CAL_POINTS - 1);
+}
+
+void cal_begin(void) {
+  eeprom_update_byte(&_cal__magic, 0xff);
+}
+
+void cal_store(uint8_t b, uint8_t i, uint8_t std, const struct adc_pair *p) {
+  struct cal_point *e;
+  uint16_t sq;
+  uint32_t full;
+
+  if (b >= CAL_BANDS || i >= CAL_POINTS) {
+    return;
+  }
+
+  e = &_cal__table[b][i];
+  sq = cal__square(p);
+
+  switch (std) {
+  case CAL_OPEN:
+    eeprom_update_word(&e->gain, sq);
+    break;
+  case CAL_SHORT:
+    // Open and short reflect in opposite phase, so whatever leaks past the
+    // bridge adds to one as much as it takes from the other. In the mean of
+    // the squares, it only adds its own square, the same as for the load.
+    full = ((uint32_t)eeprom_read_word(&e->gain) + sq) >> 1;
+    eeprom_update_word(&e->gain, full);
+    break;
+  case CAL_LOAD:
+    full = eeprom_read_word(&e->gain);
+    eeprom_update_word(&e->offset, sq);
+
+    // Calibration is the only place that divides. Limit the gain to what
+    // fits in 4.12 if the standards read about the same.
+    if (full > sq + CAL_GAIN_ONE) {
+      full = (1UL << 28) / (full - sq);
+    } else {
+      full = 0xffff;
+    }
+    eeprom_update_word(&e->gain, (full > 0xffff) ? 0xffff : full);
+    break;
+  }
+}
+
+void cal_end(void) {
+  eeprom_update_byte(&_cal__magic, CAL_MAGIC);
+}
+
+void cal_select(uint8_t b, uint32_t fa, uint32_t fb) {
+  _cal__band = b;
+  _cal__valid = (b < CAL_BANDS && eeprom_read_byte(&_cal__magic) == CAL_MAGIC);
+  _cal__fa = fa;
+  _cal__span = fb - fa;
+  _cal__scale = ((uint32_t)(CAL_POINTS - 1) << 27) / _cal__span;
+}
+
+void cal_set_freq(uint32_t hz) {
+  struct cal_point pt[2];
+  uint32_t d;
+  uint16_t w;
+  uint8_t i;
+
+  if (!_cal__valid) {
+    _cal__offset = 0;
+    _cal__gain = CAL_GAIN_ONE;
+    return;
+  }
+
+  // Clamp to the sweep range (the fine sweep of SWR min mode can run past
+  // either end of it).
+  d = (hz > _cal__fa) ? hz - _cal__fa : 0;
+  if (d > _cal__span) {
+    d = _cal__span;
+  }
+
+  // Interpolate between point i and i + 1 with weight w / 256.
+  d = (d * _cal__scale) >> 19;
+  i = d >> 8;
+  w = d & 0xff;
+  if (i >= CAL_POINTS - 1) {
+    i = CAL_POINTS - 2;
+    w = 256;
+  }
+
+  eeprom_read_block(pt, &_cal__table[_cal__band][i], sizeof(pt));
+  _cal__offset = pt[0].offset +
+    (((int32_t)pt[1].offset - pt[0].offset) * w >> 8);
+  _cal__gain = pt[0].gain +
+    (((int32_t)pt[1].gain - pt[0].gain) * w >> 8);
+}
+
+uint16_t cal_apply(uint16_t gamma) {
+  uint16_t sq;
+  uint32_t t;
+
+  if (_cal__offset == 0 && _cal__gain == CAL_GAIN_ONE) {
+    return gamma;
+  }
+
+  sq = ((uint32_t)gamma * gamma) >> 16;
+  if (sq <= _cal__offset) {
+    return 0;
+  }
+
+  t = ((uint32_t)(sq - _cal__offset) * _cal__gain) >> 12;
+  if (t > 0xffff) {
+    return 0xffff;
+  }
+
+  return cal__sqrt(t);
+}
@@ -0,0 +1,65 @@
+#ifndef _CAL_H
+#define _CAL_H
+
+#include <stdint.h>
+
+#include "adc.h"
+
+/*
+ * Open/short/load calibration of the bridge and detectors.
+ *
+ * Calibration mode reads |Γ| of each standard at CAL_POINTS frequencies
+ * evenly spread over the sweep range of every band. The load reads what
+ * leaks past the bridge (directivity) and the detector offsets; open and
+ * short read a full reflection as seen through the reverse path (tracking).
+ *
+ * Only magnitudes are known, and the leakage adds to a reflection in any
+ * phase. Averaged over phase, the squares of the magnitudes add, and for
+ * open and short, which reflect in opposite phases, the mean of the squares
+ * is exactly the sum of the squares. So the correction works on |Γ|^2: per
+ * point the EEPROM keeps the offset and gain that map the load to 0 and
+ * the mean of open and short to 1. It can't remove the error of a load
+ * whose reflection happens to add to or cancel the leakage in phase.
+ *
+ * To measure, select the band once per sweep and the frequency once per
+ * point. That interpolates between the two nearest calibrated points, so
+ * correcting a reading is a couple of multiplications and a square root
+ * from a table. Without a complete calibration, readings are left alone.
+ */
+
+// Calibrated frequencies per band.
+#define CAL_POINTS 16
+
+// Calibrated bands, at least as many as main.c has.
+#define CAL_BANDS 10
+
+// Standards, in the order calibration mode asks for them.
+#define CAL_OPEN 0
+#define CAL_SHORT 1
+#define CAL_LOAD 2
+#define CAL_STANDARDS 3
+
+// Return the frequency of calibration point i of a band swept from fa to fb.
+uint32_t cal_point_hz(uint32_t fa, uint32_t fb, uint8_t i);
+
+// Invalidate the calibration until cal_end.
+void cal_begin(void);
+
+// Store the reading of standard std at point i of band b. Must run for
+// every point with the standards in order.
+void cal_store(uint8_t b, uint8_t i, uint8_t std, const struct adc_pair *p);
+
+// Mark the calibration complete.
+void cal_end(void);
+
+// Select band b, swept from fa to fb, for cal_set_freq.
+void cal_select(uint8_t b, uint32_t fa, uint32_t fb);
+
+// Interpolate the correction for frequency hz of the selected band.
+void cal_set_freq(uint32_t hz);
+
+// Correct |Γ| (in 1/65536ths, see measure_gamma) read at the last
+// frequency set.
+uint16_t cal_apply(uint16_t gamma);
+
+#endif
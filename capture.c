@@ -0,0 +1,107 @@
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <util/delay_basic.h>
+
+#include "capture.h"
+#include "ring.h"
+
+#if CAPTURE
+
+// 1 Mbaud in double speed mode: F_CPU / (8 * (UBRR + 1)).
+#define CAPTURE_UBRR 1
+
+// Delay loops (3 cycles each) covering a frame of 10 bits.
+#define CAPTURE_FRAME_LOOPS ((10 * 8 * (CAPTURE_UBRR + 1) + 2) / 3)
+
+#define CAPTURE_RING_SIZE 64
+
+RING_DECLARE(capture_ring, uint8_t, CAPTURE_RING_SIZE);
+
+static capture_ring_t _capture__ring;
+
+// Set between capture_pause and capture_sweep.
+static volatile uint8_t _capture__paused = 0;
+
+// Send the next byte. Disables the interrupt when the ring runs empty.
+ISR(USART1_UDRE_vect) {
+  uint8_t b;
+
+  if (capture_ring_pop(&_capture__ring, &b)) {
+    UDR1 = b;
+  } else {
+    UCSR1B &= ~_BV(UDRIE1);
+  }
+}
+
+// Queue byte and make sure the interrupt drains it.
+// Interrupts stay disabled while pushing, because the ADC interrupt handler
+// pushes samples to the same ring.
+static void capture__put(uint8_t b) {
+  uint8_t sreg = SREG;
+
+  if (_capture__paused) {
+    return;
+  }
+
+  cli();
+  capture_ring_push_wait(&_capture__ring, &b);
+  UCSR1B |= _BV(UDRIE1);
+  SREG = sreg;
+}
+
+void capture_init(void) {
+  capture_ring_init(&_capture__ring);
+
+  // Transmitter only, 8 data bits, no parity, 1 stop bit.
+  UBRR1 = CAPTURE_UBRR;
+  UCSR1A = _BV(U2X1);
+  UCSR1C = _BV(UCSZ11) | _BV(UCSZ10);
+  UCSR1B = _BV(TXEN1);
+}
+
+void capture_sweep(uint8_t mode, uint8_t band) {
+  _capture__paused = 0;
+  capture__put(CAPTURE_SWEEP);
+  capture__put(mode);
+  capture__put(band);
+}
+
+void capture_pause(void) {
+  _capture__paused = 1;
+
+  // The transmit interrupt disables itself once the ring is empty and the
+  // last byte moved to the shift register.
+  while (UCSR1B & _BV(UDRIE1)) {
+    task_yield();
+  }
+  _delay_loop_1(CAPTURE_FRAME_LOOPS);
+}
+
+void capture_freq(uint32_t hz, uint16_t settle_us) {
+  uint8_t i;
+
+  capture__put(CAPTURE_FREQ);
+  for (i = 0; i < 4; i++) {
+    capture__put(hz & 0xff);
+    hz >>= 8;
+  }
+  capture__put(settle_us & 0xff);
+  capture__put(settle_us >> 8);
+}
+
+void capture_sample_from_isr(uint8_t channel, uint16_t count) {
+  uint8_t b[2];
+
+  // Drop the whole record rather than half of it.
+  if (_capture__paused || capture_ring_count(&_capture__ring) > CAPTURE_RING_SIZE - sizeof(b)) {
+    return;
+  }
+
+  b[0] = ((channel & 7) << 2) | ((count >> 8) & 3);
+  b[1] = count & 0xff;
+  capture_ring_push(&_capture__ring, &b[0]);
+  capture_ring_push(&_capture__ring, &b[1]);
+  UCSR1B |= _BV(UDRIE1);
+}
+
+#endif
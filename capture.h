@@ -0,0 +1,57 @@
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include <stdint.h>
+
+/*
+ * Capture of raw measurements.
+ *
+ * With CAPTURE defined, every DDS frequency and raw ADC count that the sweep
+ * code uses is streamed out of USART1 (TX on PD3, 1 Mbaud, 8N1). A byte ring
+ * drained by the transmit interrupt decouples the sweep from the UART. If
+ * the ring is full the sweep waits. The ADC interrupt handler can't wait
+ * and drops the sample instead, but the ADC produces 20 KB/s at most and
+ * the UART sends 100 KB/s.
+ *
+ * The stream is a sequence of records, distinguished by their first byte:
+ *
+ *   0x80 mode band           A sweep starts.
+ *   0x81 hz[4] settle_us[2]  The DDS was set to hz and the detectors were
+ *                            given settle_us to settle (little endian).
+ *   0b000ccchh ll            Raw count (hh << 8) | ll of ADC channel ccc
+ *                            (6 is forward, 7 is reverse).
+ *
+ * The simulation replays a capture into the unchanged sweep code (see
+ * sim/replay.c).
+ *
+ * Sweeps in quiet mode (see adc_set_quiet) aren't captured: the USART stops
+ * with the I/O clock in ADC Noise Reduction sleep, and its activity is the
+ * noise that sleep is meant to keep away from the ADC.
+ */
+
+#define CAPTURE_SWEEP 0x80
+#define CAPTURE_FREQ 0x81
+
+#if CAPTURE
+void capture_init(void);
+
+// Resumes capturing after capture_pause.
+void capture_sweep(uint8_t mode, uint8_t band);
+
+// Stop capturing until the next capture_sweep. Waits until the last byte
+// was sent.
+void capture_pause(void);
+
+void capture_freq(uint32_t hz, uint16_t settle_us);
+
+// Call from the ADC interrupt handler (with interrupts disabled).
+void capture_sample_from_isr(uint8_t channel, uint16_t count);
+#else
+#define capture_init()
+#define capture_sweep(mode, band)
+#define capture_pause()
+#define capture_freq(hz, settle_us)
+#define capture_sample_from_isr(channel, count)
+#endif
+
+#endif
@@ -9,31 +9,6 @@ typedef enum {
   DATA        = 1,
 } mode_t;
 
-static void lcd_yield_usec(int16_t usec) {
-  uint16_t t1;
-  uint16_t t2;
-  uint16_t dt;
-
-  t1 = task_usec();
-  for (;;) {
-    task_yield();
-    t2 = task_usec();
-
-    if (t2 > t1) {
-      dt = t2 - t1;
-    } else {
-      dt = t2 + (UINT16_MAX - t1) + 1;
-    }
-
-    if (dt >= usec) {
-      break;
-    }
-
-    usec -= dt;
-    t1 = t2;
-  }
-}
-
 // Return Nth bit.
 #define BIT(v, n) (((v) >> (n)) & 0x1)
 
@@ -46,9 +21,9 @@ static void __write4(uint8_t b) {
   PORTB |= (BIT(b, 0) << PB1);
   // Trigger rising edge on enable pin.
   PORTB &= ~_BV(PB5);
-  lcd_yield_usec(1);
+  task_sleep_us(1);
   PORTB |= _BV(PB5);
-  lcd_yield_usec(1);
+  task_sleep_us(1);
   PORTB &= ~_BV(PB5);
 }
 
@@ -58,9 +33,9 @@ static void lcd_send(mode_t m, uint8_t b) {
   PORTB |= (m << PB4);
   // Write byte in 2 steps
   __write4(b >> 4);
-  lcd_yield_usec(37);
+  task_sleep_us(37);
   __write4(b >> 0);
-  lcd_yield_usec(37);
+  task_sleep_us(37);
 }
 
 void lcd_init(void) {
@@ -69,29 +44,29 @@ void lcd_init(void) {
   PORTB &= ~(_BV(PB4) | _BV(PB5) | _BV(PB6) | _BV(PB2) | _BV(PB3) | _BV(PB1));
 
   // Wait 10ms after power up.
-  lcd_yield_usec(10000);
+  task_sleep_us(10000);
 
   // Initialize for 4-bit data transfer.
   __write4(0b0011);
-  lcd_yield_usec(4100);
+  task_sleep_us(4100);
   __write4(0b0011);
-  lcd_yield_usec(100);
+  task_sleep_us(100);
   __write4(0b0011);
-  lcd_yield_usec(37);
+  task_sleep_us(37);
   __write4(0b0010);
-  lcd_yield_usec(37);
+  task_sleep_us(37);
 
   // Function set: 4-bit data, 2 display lines, 5x8 font
   lcd_send(INSTRUCTION, 0b00101000);
-  lcd_yield_usec(37);
+  task_sleep_us(37);
 
   // Display control: on, no cursor, no blink
   lcd_send(INSTRUCTION, 0b00001100);
-  lcd_yield_usec(37);
+  task_sleep_us(37);
 
   // Entry mode set: increment cursor by 1
   lcd_send(INSTRUCTION, 0b00000110);
-  lcd_yield_usec(37);
+  task_sleep_us(37);
 
   // Clear and initialize cursor
   lcd_clear_display();
@@ -100,22 +75,22 @@ void lcd_init(void) {
 
 void lcd_clear_display(void) {
   lcd_send(INSTRUCTION, 0b00000001);
-  lcd_yield_usec(1520);
+  task_sleep_us(1520);
 }
 
 void lcd_return_home(void) {
   lcd_send(INSTRUCTION, 0b00000010);
-  lcd_yield_usec(1520);
+  task_sleep_us(1520);
 }
 
 void lcd_setline(int8_t line) {
   lcd_send(INSTRUCTION, 0b10000000 + line * 0x40);
-  lcd_yield_usec(37);
+  task_sleep_us(37);
 }
 
 void lcd_putc(char c) {
   lcd_send(DATA, c);
-  lcd_yield_usec(37);
+  task_sleep_us(37);
 }
 
 void lcd_puts(const char *buf) {
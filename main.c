@@ -2,9 +2,14 @@
 #include <avr/io.h>
 #include <avr/pgmspace.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "ad9850.h"
+#include "adc.h"
+#include "cal.h"
+#include "capture.h"
 #include "hd44780u.h"
+#include "measure.h"
 #include "task.h"
 
 #define MIN(a, b) (((a) > (b)) ? (b) : (a));
@@ -12,6 +17,15 @@
 
 struct mode {
   PGM_P name;
+
+  // Every reading sums 4^k conversions per input, for 10 + k bits (see
+  // adc.h). Each step of k quadruples the time a reading takes.
+  uint8_t oversample;
+
+  // Convert in ADC Noise Reduction sleep, away from the noise of the CPU and
+  // the I/O clock (see adc_set_quiet). Readings take longer, so only the
+  // modes that take few readings use it.
+  uint8_t quiet;
 };
 
 const char mode_swr_min[] PROGMEM = "SWR min";
@@ -19,25 +33,58 @@ const char mode_band_start[] PROGMEM = "band start";
 const char mode_band_stop[] PROGMEM = "band stop";
 const char mode_band_mid[] PROGMEM = "band mid";
 const char mode_band_edge[] PROGMEM = "band edge";
+const char mode_calibrate[] PROGMEM = "calibrate";
+
+// Index of the calibration mode in modes[].
+#define MODE_CALIBRATE 5
 
 const struct mode modes[] PROGMEM = {
   {
     .name = mode_swr_min,
+    .oversample = 1,
   },
   {
     .name = mode_band_start,
+    .oversample = 2,
+    .quiet = 1,
   },
   {
     .name = mode_band_stop,
+    .oversample = 2,
+    .quiet = 1,
   },
   {
     .name = mode_band_mid,
+    .oversample = 2,
+    .quiet = 1,
   },
   {
     .name = mode_band_edge,
+    .oversample = 2,
   },
+  {
+    .name = mode_calibrate,
+    .oversample = 3,
+    .quiet = 1,
+  },
+};
+
+const char cal_open[] PROGMEM = "open";
+const char cal_short[] PROGMEM = "short";
+const char cal_load[] PROGMEM = "load";
+
+// Names of the calibration standards (see cal.h).
+PGM_P const cal_standards[CAL_STANDARDS] PROGMEM = {
+  cal_open,
+  cal_short,
+  cal_load,
 };
 
+// Steps of calibration mode, for every standard.
+#define CAL_STEP_CONNECT 0
+#define CAL_STEP_MEASURE 1
+#define CAL_STEP_DONE 2
+
 struct band {
   PGM_P name;
 
@@ -136,14 +183,43 @@ const struct band bands[] PROGMEM = {
 
 // Current mode.
 uint8_t mode_index = 0;
-struct band mode_cur;
+struct mode mode_cur;
 
 // Current band.
 uint8_t band_index = 0;
 struct band band_cur;
 
-// The sweep task writes its output directly to this buffer.
-char lcd_buffer[2][17];
+// Result of a sweep, posted by the sweep task to the control task.
+struct sweep_result {
+  uint8_t mode;
+
+  // Frequency (all modes except band edge).
+  uint32_t hz;
+
+  // Band edge mode uses all three for start, middle and stop of band.
+  struct measure m[3];
+
+  // Calibration mode shows the step it is at with a standard.
+  uint8_t cal_std;
+  uint8_t cal_step;
+};
+
+TASK_MBOX_DEFINE(sweep_results, struct sweep_result, 2);
+
+// Set by the control task when the band button confirms that the standard
+// calibration mode asks for is connected.
+volatile uint8_t cal_confirmed = 0;
+
+// Hooks for the sweep benchmark (see sim/bench.c).
+#if BENCH
+void bench_sweep_start(uint8_t mode, uint8_t band);
+void bench_sweep_done(uint32_t hz, uint16_t vswr);
+void bench_result_shown(uint8_t mode, uint32_t hz, uint16_t vswr);
+#else
+#define bench_sweep_start(mode, band)
+#define bench_sweep_done(hz, vswr)
+#define bench_result_shown(mode, hz, vswr)
+#endif
 
 // Show mode/band selection on LCD display.
 void lcd_show_mode_band() {
@@ -156,6 +232,88 @@ void lcd_show_mode_band() {
   lcd_puts_P(band_cur.name);
 }
 
+// Show calibration step on LCD display.
+void lcd_show_cal(const struct sweep_result *r) {
+  PGM_P name;
+
+  memcpy_P(&name, &cal_standards[r->cal_std], sizeof(name));
+
+  lcd_clear_display();
+  lcd_setline(0);
+
+  switch (r->cal_step) {
+  case CAL_STEP_CONNECT:
+    lcd_puts("Connect ");
+    lcd_puts_P(name);
+    lcd_setline(1);
+    lcd_puts("and press band");
+    break;
+  case CAL_STEP_MEASURE:
+    lcd_puts("Calibrating");
+    lcd_setline(1);
+    lcd_puts_P(name);
+    break;
+  default:
+    lcd_puts("Calibrated");
+    break;
+  }
+}
+
+// Show sweep result on LCD display.
+void lcd_show_result(const struct sweep_result *r) {
+  char line[17];
+
+  if (r->mode == MODE_CALIBRATE) {
+    lcd_show_cal(r);
+    return;
+  }
+
+  lcd_clear_display();
+  lcd_setline(0);
+
+  if (r->mode == 4) {
+    uint16_t vswr[3];
+
+    // Only one digit fits before the decimal point.
+    for (uint8_t i = 0; i < 3; i++) {
+      vswr[i] = MIN(9999, r->m[i].vswr);
+    }
+
+    lcd_puts("A     B     C");
+    snprintf(
+      line,
+      sizeof(line),
+      "%1u.%02u  %1u.%02u  %1u.%02u",
+      (vswr[0] / 1000),
+      (vswr[0] % 1000) / 10,
+      (vswr[1] / 1000),
+      (vswr[1] % 1000) / 10,
+      (vswr[2] / 1000),
+      (vswr[2] % 1000) / 10);
+  } else {
+    snprintf(
+      line,
+      sizeof(line),
+      "Freq: %2lu.%06lu",
+      (unsigned long)(r->hz / 1000000),
+      (unsigned long)(r->hz % 1000000));
+    lcd_puts(line);
+    snprintf(
+      line,
+      sizeof(line),
+      "SWR: %2u.%03u",
+      r->m[0].vswr / 1000,
+      r->m[0].vswr % 1000);
+  }
+
+  lcd_setline(1);
+  lcd_puts(line);
+}
+
+// Interval between polls of the buttons, in milliseconds.
+// A press lasts longer than this.
+#define BUTTON_POLL_MS 20
+
 // Returns if the state has changed and the previous state was true-ish.
 // This is the equivalent of a key-up event.
 int8_t button_check(uint8_t* prev, uint8_t cur) {
@@ -164,25 +322,18 @@ int8_t button_check(uint8_t* prev, uint8_t cur) {
   return ok;
 }
 
-// Subtract two uint16_t values, taking overflows into account.
-uint16_t time_substr(uint16_t t2, uint16_t t1) {
-  if (t2 > t1) {
-    return t2 - t1;
-  } else {
-    return t2 + (UINT16_MAX - t1) + 1;
-  }
-}
-
 void control_task(void* unused) {
   lcd_init();
 
-  uint16_t time_button = task_msec();
-  uint16_t time_tick;
+  uint32_t time_button = task_now();
+  uint32_t poll = task_now();
+  int32_t wait;
+  struct sweep_result result;
+  struct sweep_result next;
+  uint8_t have_result = 0;
   uint8_t idle = 0;
   uint8_t mode_button_prev = 0;
   uint8_t band_button_prev = 0;
-  memcpy_P(&mode_cur, &modes[mode_index], sizeof(struct mode));
-  memcpy_P(&band_cur, &bands[band_index], sizeof(struct band));
   lcd_show_mode_band();
 
   while (1) {
@@ -198,6 +349,13 @@ void control_task(void* unused) {
       sei();
     }
 
+    // In calibration mode, the band button confirms the standard while the
+    // LCD is idle and shows which one to connect.
+    if (idle && band_button && mode_index == MODE_CALIBRATE) {
+      cal_confirmed = 1;
+      band_button = 0;
+    }
+
     if (!idle && band_button) {
       cli();
       band_index = (band_index + 1) % (sizeof(bands) / sizeof(bands[0]));
@@ -208,98 +366,75 @@ void control_task(void* unused) {
     // Refresh LCD with mode/band selection if any button was pressed.
     if (mode_button || band_button) {
       lcd_show_mode_band();
-      time_button = task_msec();
+      time_button = task_now();
       idle = 0;
     }
 
     // Switch to idle mode when last button press is >= 1 second ago.
-    if (!idle && time_substr(task_msec(), time_button) >= 1000) {
+    if (!idle && task_now() - time_button >= TASK_MSEC_TO_TICKS(1000)) {
       idle = 1;
-      time_tick = time_substr(task_msec(), 500);
+      if (have_result) {
+        lcd_show_result(&result);
+        bench_result_shown(result.mode, result.hz, result.m[0].vswr);
+      } else {
+        lcd_clear_display();
+      }
     }
 
-    // Refresh LCD if enough time has passed since previous refresh.
-    if (idle && time_substr(task_msec(), time_tick) >= 500) {
-      time_tick = task_msec();
-      lcd_clear_display();
-      lcd_setline(0);
-      lcd_puts(lcd_buffer[0]);
-      lcd_setline(1);
-      lcd_puts(lcd_buffer[1]);
+    // Wait for sweep results until the buttons are due to be polled again.
+    // Only redraw the LCD if the result has changed.
+    poll += TASK_MSEC_TO_TICKS(BUTTON_POLL_MS);
+    for (;;) {
+      wait = poll - task_now();
+      if (wait <= 0 || !task_mbox_receive_timeout(&sweep_results, &next, wait * MS_PER_TICK)) {
+        break;
+      }
+      if (!have_result || memcmp(&next, &result, sizeof(result)) != 0) {
+        result = next;
+        have_result = 1;
+        if (idle) {
+          lcd_show_result(&result);
+        }
+      }
+      if (idle) {
+        bench_result_shown(next.mode, next.hz, next.m[0].vswr);
+      }
     }
 
-    task_sleep(0);
+    // Start over from now if redrawing the LCD overran the poll, instead of
+    // catching up on the polls it missed.
+    if (wait < 0) {
+      poll = task_now();
+    }
   }
 }
 
-// Pointer to task waiting for ADC conversion.
-task_t* task_adc = 0;
-
-// Wake up task waiting for ADC conversion.
-ISR(ADC_vect) {
-  task_wakeup(task_adc);
-}
-
-uint16_t adc_sample(uint8_t port) {
-  uint8_t adcl, adch;
-
-  // Select port.
-  ADMUX = _BV(REFS0) | port;
-
-  // ADC Start Conversion.
-  ADCSRA |= (_BV(ADSC) | _BV(ADIE));
+// Take a reading of 4^k conversions per input.
+void reading_sample(uint8_t k, struct measure *m) {
+  struct adc_pair p;
 
-  // Wait for ADC Conversion Complete interrupt.
-  task_adc = task_current();
-  task_suspend(0);
-
-  // Load and combine result.
-  adcl = ADCL;
-  adch = ADCH;
-  return (adch << 8) | adcl;
+  adc_acquire(k, &p);
+  measure_from_gamma(cal_apply(measure_gamma(&p)), m);
 }
 
-uint16_t vswr_sample() {
-  uint32_t fwd;
-  uint32_t rev;
-  uint32_t vswr;
-
-  // Forward power (channel A1, port ADC6).
-  fwd = adc_sample(6);
-
-  // Reverse power (channel A0, port ADC7).
-  rev = adc_sample(7);
-
-  // Compute integer VSWR (in thousandths).
-  vswr = (1000 * (fwd + rev)) / (fwd - rev);
-  if (vswr > 0xffff) {
-    vswr = 0xffff;
-  }
-
-  return vswr;
-}
-
-uint16_t vswr_at_frequency(uint32_t hz, uint8_t delay) {
+void reading_at_frequency(uint32_t hz, uint16_t settle_us, uint8_t k, struct measure *m) {
   dds_set_freq(hz);
-  task_sleep(delay);
-  return vswr_sample();
+  cal_set_freq(hz);
+  task_sleep_us(settle_us);
+  capture_freq(hz, settle_us);
+  reading_sample(k, m);
 }
 
-uint16_t avg_vswr_at_frequency(uint32_t hz, uint8_t n) {
-  uint32_t sum = 0;
-  uint8_t i;
-
+// Averages the counts rather than the VSWR of 4^k conversions, so the
+// result has k more bits of resolution.
+void avg_reading_at_frequency(uint32_t hz, uint8_t k, struct measure *m) {
   // Configure frequency and let settle.
   dds_set_freq(hz);
+  cal_set_freq(hz);
   task_sleep(20);
+  capture_freq(hz, 20000);
 
-  // Take multiple measurements.
-  for (i = 0; i < n; i++) {
-    sum += vswr_sample();
-  }
-
-  // Compute average.
-  return sum / n;
+  reading_sample(k, m);
 }
 
 uint32_t round_step_size(uint32_t step_size) {
@@ -327,8 +462,14 @@ uint32_t round_step_size(uint32_t step_size) {
   return base * step_size;
 }
 
-void sweep_swr_min(struct band band) {
-  uint16_t min_vswr = UINT16_MAX;
+void sweep_swr_min(struct band band, uint8_t k, struct sweep_result *r) {
+  struct measure min = {
+    .gamma = UINT16_MAX,
+    .rl = 0,
+    .vswr = UINT16_MAX,
+    .z = UINT16_MAX,
+  };
+  struct measure m;
   uint32_t min_hz = 0;
   uint32_t start;
   uint32_t stop;
@@ -336,7 +477,7 @@ void sweep_swr_min(struct band band) {
 
   // Sweep entire band.
   //
-  // Use zero delay when computing VSWR for a frequency. This will not
+  // Use 1ms delay when computing VSWR for a frequency. This will not
   // result in an accurate reading but is good enough to find a rough
   // frequency where the VSWR is minimal.
   //
@@ -344,9 +485,9 @@ void sweep_swr_min(struct band band) {
   stop = band.fb;
   step_size = round_step_size((stop - start) / 100);
   for (uint32_t hz = start; hz < stop; hz += step_size) {
-    uint16_t vswr = vswr_at_frequency(hz, 0);
-    if (vswr < min_vswr) {
-      min_vswr = vswr;
+    reading_at_frequency(hz, 1000, 0, &m);
+    if (m.gamma < min.gamma) {
+      min = m;
       min_hz = hz;
     }
   }
@@ -355,114 +496,151 @@ void sweep_swr_min(struct band band) {
   //
   // Use 10ms delay when computing VSWR for a frequency. This results
   // in a more accurate reading than before, because the power levels
-  // are given a chance to settle before the ADC conversion.
+  // are given a chance to settle before the ADC conversion, and
+  // because the readings are oversampled.
   //
   start = min_hz - step_size;
   stop = min_hz + step_size;
   step_size = round_step_size((stop - start) / 20);
   for (uint32_t hz = start; hz < stop; hz += step_size) {
-    uint16_t vswr = vswr_at_frequency(hz, 10);
-    if (vswr < min_vswr) {
-      min_vswr = vswr;
+    reading_at_frequency(hz, 10000, k, &m);
+    if (m.gamma < min.gamma) {
+      min = m;
       min_hz = hz;
     }
   }
 
-  snprintf(
-    lcd_buffer[0],
-    sizeof(lcd_buffer[0]),
-    "Freq: %2lu.%06lu",
-    min_hz / 1000000,
-    min_hz % 1000000);
-  snprintf(
-    lcd_buffer[1],
-    sizeof(lcd_buffer[1]),
-    "SWR: %2u.%03u",
-    min_vswr / 1000,
-    min_vswr % 1000);
+  r->hz = min_hz;
+  r->m[0] = min;
 }
 
-void sweep_band_position(struct band band, uint32_t hz) {
-  uint16_t vswr;
-
-  vswr = avg_vswr_at_frequency(hz, 20);
-
-  snprintf(
-    lcd_buffer[0],
-    sizeof(lcd_buffer[0]),
-    "Freq: %2lu.%06lu",
-    hz / 1000000,
-    hz % 1000000);
-  snprintf(
-    lcd_buffer[1],
-    sizeof(lcd_buffer[1]),
-    "SWR: %2u.%03u",
-    vswr / 1000,
-    vswr % 1000);
+void sweep_band_position(struct band band, uint32_t hz, uint8_t k, struct sweep_result *r) {
+  r->hz = hz;
+  avg_reading_at_frequency(hz, k, &r->m[0]);
 }
 
-void sweep_band_edges(struct band band) {
-  uint16_t low;
-  uint16_t mid;
-  uint16_t high;
-
-  low = avg_vswr_at_frequency(band.start, 20);
-  low = MIN(9999, low);
-  mid = avg_vswr_at_frequency((band.start + band.stop) / 2, 20);
-  mid = MIN(9999, mid);
-  high = avg_vswr_at_frequency(band.stop, 20);
-  high = MIN(9999, high);
-
-  snprintf(
-    lcd_buffer[0],
-    sizeof(lcd_buffer[0]),
-    "A     B     C");
-  snprintf(
-    lcd_buffer[1],
-    sizeof(lcd_buffer[1]),
-    "%1u.%02u  %1u.%02u  %1u.%02u",
-    (low / 1000),
-    (low % 1000) / 10,
-    (mid / 1000),
-    (mid % 1000) / 10,
-    (high / 1000),
-    (high % 1000) / 10);
+void sweep_band_edges(struct band band, uint8_t k, struct sweep_result *r) {
+  avg_reading_at_frequency(band.start, k, &r->m[0]);
+  avg_reading_at_frequency((band.start + band.stop) / 2, k, &r->m[1]);
+  avg_reading_at_frequency(band.stop, k, &r->m[2]);
+
+  r->hz = 0;
 }
 
-void sweep_task(void* unused) {
-  // ADC Enable.
-  ADCSRA = _BV(ADEN);
+// Wait for the standard to be confirmed. Returns 0 if another mode is
+// selected instead.
+uint8_t cal_wait_confirmed(void) {
+  while (mode_index == MODE_CALIBRATE) {
+    if (cal_confirmed) {
+      return 1;
+    }
+    task_sleep(100);
+  }
+
+  return 0;
+}
 
-  // Prescaler at 128 to turn 16 MHz into 125 KHz.
-  ADCSRA |= _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+// Post calibration step for the control task to show.
+void cal_post(struct sweep_result *r, uint8_t std, uint8_t step) {
+  r->cal_std = std;
+  r->cal_step = step;
+  task_mbox_post(&sweep_results, r);
+}
+
+// Read every standard at the calibration points of all bands, and keep
+// showing the result until another mode is selected. Selecting another mode
+// halfway leaves the analyzer uncalibrated.
+void sweep_calibrate(uint8_t k, struct sweep_result *r) {
+  struct band band;
+  struct adc_pair p;
+
+  for (uint8_t std = 0; std < CAL_STANDARDS; std++) {
+    cal_confirmed = 0;
+    cal_post(r, std, CAL_STEP_CONNECT);
+    if (!cal_wait_confirmed()) {
+      return;
+    }
+
+    cal_post(r, std, CAL_STEP_MEASURE);
+    if (std == 0) {
+      cal_begin();
+    }
+
+    for (uint8_t b = 0; b < sizeof(bands) / sizeof(bands[0]); b++) {
+      memcpy_P(&band, &bands[b], sizeof(struct band));
+      for (uint8_t i = 0; i < CAL_POINTS; i++) {
+        uint32_t hz = cal_point_hz(band.fa, band.fb, i);
+
+        if (mode_index != MODE_CALIBRATE) {
+          return;
+        }
+
+        // Same settle time as the band modes.
+        dds_set_freq(hz);
+        task_sleep(20);
+        capture_freq(hz, 20000);
+        adc_acquire(k, &p);
+        cal_store(b, i, std, &p);
+      }
+    }
+  }
 
-  // Ports ADC6 and ADC7 are inputs.
-  DDRF &= ~_BV(DDF7);
-  DDRF &= ~_BV(DDF6);
-  PORTF &= ~_BV(PF7);
-  PORTF &= ~_BV(PF6);
+  cal_end();
+  cal_post(r, CAL_LOAD, CAL_STEP_DONE);
+  while (mode_index == MODE_CALIBRATE) {
+    task_sleep(100);
+  }
+}
 
+void sweep_task(void* unused) {
+  adc_init();
   dds_init();
   dds_reset();
+  capture_init();
 
   while (1) {
-    switch (mode_index) {
+    struct sweep_result r;
+    uint8_t quiet;
+    uint8_t k;
+
+    memset(&r, 0, sizeof(r));
+    r.mode = mode_index;
+    cal_select(band_index, band_cur.fa, band_cur.fb);
+    k = pgm_read_byte(&modes[r.mode].oversample);
+    quiet = pgm_read_byte(&modes[r.mode].quiet);
+    adc_set_quiet(quiet);
+    bench_sweep_start(r.mode, band_index);
+    if (quiet) {
+      capture_pause();
+    } else {
+      capture_sweep(r.mode, band_index);
+    }
+    switch (r.mode) {
     case 0:
-      sweep_swr_min(band_cur);
+      sweep_swr_min(band_cur, k, &r);
       break;
     case 1:
-      sweep_band_position(band_cur, band_cur.start);
+      sweep_band_position(band_cur, band_cur.start, k, &r);
       break;
     case 2:
-      sweep_band_position(band_cur, band_cur.stop);
+      sweep_band_position(band_cur, band_cur.stop, k, &r);
       break;
     case 3:
-      sweep_band_position(band_cur, (band_cur.start + band_cur.stop) / 2);
+      sweep_band_position(band_cur, (band_cur.start + band_cur.stop) / 2, k, &r);
       break;
     case 4:
-      sweep_band_edges(band_cur);
+      sweep_band_edges(band_cur, k, &r);
       break;
+    case MODE_CALIBRATE:
+      // Posts its own results.
+      sweep_calibrate(k, &r);
+      continue;
     }
+
+    bench_sweep_done(r.hz, r.m[0].vswr);
+
+    // Drop the result if the control task hasn't picked up earlier ones.
+    task_mbox_post(&sweep_results, &r);
     task_yield();
   }
 }
@@ -481,12 +659,19 @@ void setup() {
 
   // Band button (PF4) is an input.
   DDRF &= ~_BV(DDF4);
+
+  // Load the initial mode and band before the sweep task starts using them.
+  memcpy_P(&mode_cur, &modes[mode_index], sizeof(struct mode));
+  memcpy_P(&band_cur, &bands[band_index], sizeof(struct band));
 }
 
+TASK_DEFINE(control, control_task, 0, TASK_STACK_SIZE, TASK_PRIO_DEFAULT);
+
+// The sweep task preempts the control task when its ADC conversion completes.
+TASK_DEFINE(sweep, sweep_task, 0, TASK_STACK_SIZE, TASK_PRIO_DEFAULT + 1);
+
 int main() {
   setup();
   task_init();
-  task_create(control_task, 0);
-  task_create(sweep_task, 0);
   task_start();
 }
@@ -0,0 +1,132 @@
+#include <avr/pgmspace.h>
+
+#include "measure.h"
+
+// 2^31 / m for m in the middle of each 128th of [2^15, 2^16).
+static const uint16_t _measure__recip[128] PROGMEM = {
+  65281, 64777, 64281, 63792, 63310, 62836, 62369, 61909,
+  61455, 61008, 60568, 60133, 59705, 59283, 58867, 58457,
+  58053, 57654, 57260, 56872, 56489, 56111, 55738, 55370,
+  55007, 54649, 54295, 53946, 53601, 53261, 52925, 52593,
+  52265, 51942, 51622, 51306, 50995, 50686, 50382, 50081,
+  49784, 49490, 49200, 48913, 48630, 48349, 48072, 47798,
+  47528, 47260, 46995, 46733, 46474, 46218, 45965, 45714,
+  45467, 45222, 44979, 44739, 44502, 44267, 44035, 43805,
+  43577, 43352, 43129, 42908, 42690, 42474, 42260, 42048,
+  41838, 41631, 41425, 41222, 41020, 40820, 40623, 40427,
+  40233, 40041, 39851, 39662, 39476, 39291, 39108, 38926,
+  38746, 38568, 38392, 38217, 38044, 37872, 37702, 37533,
+  37366, 37200, 37036, 36873, 36712, 36552, 36393, 36236,
+  36080, 35926, 35772, 35620, 35470, 35320, 35172, 35026,
+  34880, 34735, 34592, 34450, 34309, 34169, 34031, 33893,
+  33757, 33622, 33487, 33354, 33222, 33091, 32961, 32832,
+};
+
+// log2(1 + i / 64) in 4.12 fixed point.
+static const uint16_t _measure__log2[65] PROGMEM = {
+  0, 92, 182, 271, 358, 445, 530, 613,
+  696, 778, 858, 937, 1016, 1093, 1169, 1244,
+  1319, 1392, 1465, 1536, 1607, 1677, 1746, 1814,
+  1882, 1949, 2015, 2080, 2145, 2208, 2272, 2334,
+  2396, 2457, 2518, 2578, 2637, 2696, 2754, 2812,
+  2869, 2926, 2982, 3037, 3092, 3146, 3200, 3254,
+  3307, 3359, 3412, 3463, 3514, 3565, 3615, 3665,
+  3715, 3764, 3812, 3861, 3908, 3956, 4003, 4050,
+  4096,
+};
+
+// 2000 * log10(2) / 4096 in 0.18 fixed point, to turn a difference of
+// 4.12 logarithms into hundredths of a dB of power.
+#define MEASURE_RL_SCALE 38532
+
+// Shift x (not zero) left until its top bit is set and return the shift.
+static uint8_t measure__normalize(uint16_t *x) {
+  uint8_t s = 0;
+
+  while (!(*x & 0x8000)) {
+    *x <<= 1;
+    s++;
+  }
+
+  return s;
+}
+
+// Return a / b (b not zero) in 16.16 fixed point.
+static uint32_t measure__ratio(uint16_t a, uint16_t b) {
+  uint8_t s = measure__normalize(&b);
+  uint32_t r;
+  int32_t e;
+
+  // Now b is in [2^15, 2^16) and r approximates 2^31 / b to 8 bits. One
+  // Newton-Raphson step, r += r * (1 - b * r), makes that 16 bits. It
+  // falls short by at most one, so round up to get exact quotients right.
+  r = pgm_read_word(&_measure__recip[(b >> 8) & 0x7f]);
+  e = (int32_t)(0x80000000UL - (uint32_t)b * r);
+  r += (((int32_t)r * (e >> 9)) >> 22) + 1;
+
+  // a / b = a * r / 2^(31 - s), and s is at most 15.
+  return ((uint32_t)a * r) >> (15 - s);
+}
+
+// Return log2(x) (x not zero) in 4.12 fixed point.
+static uint16_t measure__log2(uint16_t x) {
+  uint8_t s = measure__normalize(&x);
+  uint8_t i = (x >> 9) & 0x3f;
+  uint16_t lo = pgm_read_word(&_measure__log2[i]);
+  uint16_t hi = pgm_read_word(&_measure__log2[i + 1]);
+
+  // Interpolate between the 64ths with the 9 bits below the index.
+  return ((uint16_t)(15 - s) << 12) + lo +
+    (((uint32_t)(hi - lo) * (x & 0x1ff)) >> 9);
+}
+
+uint16_t measure_gamma(const struct adc_pair *p) {
+  uint32_t gamma;
+
+  // Severe mismatch, or no signal at all.
+  if (p->rev >= p->fwd) {
+    return 0xffff;
+  }
+
+  gamma = measure__ratio(p->rev, p->fwd);
+  return (gamma > 0xffff) ? 0xffff : gamma;
+}
+
+void measure_from_gamma(uint16_t gamma, struct measure *m) {
+  uint32_t vswr;
+
+  m->gamma = gamma;
+
+  // Perfect match.
+  if (gamma == 0) {
+    m->rl = 0xffff;
+    m->vswr = 1000;
+    m->z = 10 * MEASURE_Z0;
+    return;
+  }
+
+  // -20 log10 |Γ| = 20 log10(2) (16 - log2(2^16 |Γ|)).
+  m->rl = (((16UL << 12) - measure__log2(gamma)) *
+           MEASURE_RL_SCALE + (1UL << 17)) >> 18;
+
+  // VSWR in thousandths stops fitting 16 bits above 65.535, which it
+  // reaches at |Γ| = 63567 / 65536 (after rounding, see below).
+  if (gamma >= 63567) {
+    m->vswr = 0xffff;
+    m->z = 0xffff;
+    return;
+  }
+
+  // VSWR = (1 + |Γ|) / (1 - |Γ|), with the numerator halved to fit 16 bits.
+  vswr = measure__ratio((0x10000UL + gamma) >> 1, 0x10000UL - gamma) << 1;
+
+  // Tenths of an ohm.
+  m->z = (vswr * (10 * MEASURE_Z0) + 0x8000) >> 16;
+
+  // 1000 / 2^16 is 125 / 2^13. Round, so that 1.5 doesn't read 1.499.
+  m->vswr = (vswr * 125 + 0x1000) >> 13;
+}
+
+void measure_compute(const struct adc_pair *p, struct measure *m) {
+  measure_from_gamma(measure_gamma(p), m);
+}
@@ -0,0 +1,49 @@
+#ifndef _MEASURE_H
+#define _MEASURE_H
+
+#include <stdint.h>
+
+#include "adc.h"
+
+/*
+ * Reflection measurements from a forward/reverse detector pair.
+ *
+ * The reverse to forward ratio is the magnitude of the reflection
+ * coefficient |Γ|, from which follow return loss, VSWR and the impedance
+ * of a resistive load. Ratios are multiplications by a reciprocal that is
+ * looked up in a table and refined with one Newton-Raphson step, and return
+ * loss is a logarithm from a table, so none of it divides. A correction of
+ * |Γ| (see cal.h) goes between measure_gamma and measure_from_gamma.
+ *
+ * The detectors only see magnitudes, so a load of Z0 * VSWR reads the same
+ * as a load of Z0 / VSWR (or any reactive load on the same VSWR circle).
+ * The impedance assumes the former; the other is Z0^2 / z.
+ */
+
+// Characteristic impedance in ohms.
+#define MEASURE_Z0 50
+
+struct measure {
+  // |Γ| in 1/65536ths, up to 0xffff when reverse reaches forward.
+  uint16_t gamma;
+
+  // Return loss in hundredths of a dB, 0xffff if there is no reflection.
+  uint16_t rl;
+
+  // VSWR in thousandths, up to 0xffff.
+  uint16_t vswr;
+
+  // |Z| in tenths of an ohm of a resistive load above Z0, up to 0xffff.
+  uint16_t z;
+};
+
+// Return |Γ| of a pair in 1/65536ths, 0xffff if reverse reaches forward.
+uint16_t measure_gamma(const struct adc_pair *p);
+
+// Fill in all measurements from |Γ|.
+void measure_from_gamma(uint16_t gamma, struct measure *m);
+
+// Both of the above.
+void measure_compute(const struct adc_pair *p, struct measure *m);
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef PT_H_
+#define PT_H_
+
+#include <stdint.h>
+
+#include "queue.h"
+#include "task.h"
+
+/*
+ * Stackless protothreads.
+ *
+ * A protothread is a function that is called repeatedly and resumes where it
+ * left off, using a switch statement on the line number it last blocked at.
+ * It doesn't have a stack of its own, so local variables don't survive
+ * blocking; keep state in a struct that embeds pt_t instead.
+ *
+ * With TASK_PT defined, a single task (the protothread host) runs all
+ * protothreads that are started with task_pt_start, interleaved with the
+ * regular tasks. A blocked protothread costs a few bytes instead of a stack.
+ *
+ * Don't use a switch statement in the body of a protothread function, and
+ * use at most one blocking macro per line.
+ *
+ *   struct blink {
+ *     pt_t pt;
+ *     uint8_t n;
+ *   };
+ *
+ *   uint8_t blink_fn(pt_t *pt) {
+ *     struct blink *b = (struct blink *)pt;
+ *     PT_BEGIN(pt);
+ *     for (b->n = 0; b->n < 10; b->n++) {
+ *       PORTB ^= _BV(PB0);
+ *       PT_SLEEP(pt, 500);
+ *     }
+ *     PT_END(pt);
+ *   }
+ */
+
+// Return values of a protothread function.
+#define PT_WAITING 0 // Blocked on a condition; see task_pt_poll.
+#define PT_YIELDED 1 // Run again as soon as possible.
+#define PT_SLEEPING 2 // Run again when task_now() reaches pt->wake.
+#define PT_ENDED 3 // Done; the host forgets about it.
+
+typedef struct pt_s pt_t;
+
+typedef uint8_t (*pt_fn)(pt_t *);
+
+struct pt_s {
+  uint16_t lc; // Local continuation (line to resume at).
+  uint8_t state; // Value last returned by fn.
+  uint32_t wake; // Tick to resume at if sleeping.
+  pt_fn fn;
+
+  QUEUE member;
+};
+
+#define PT_BEGIN(pt)                                                          \
+  switch ((pt)->lc) {                                                         \
+  case 0:
+
+#define PT_END(pt)                                                            \
+  }                                                                           \
+  (pt)->lc = 0;                                                               \
+  return PT_ENDED
+
+#define PT_WAIT_UNTIL(pt, cond)                                               \
+  do {                                                                        \
+    (pt)->lc = __LINE__;                                                      \
+  case __LINE__:                                                              \
+    if (!(cond)) {                                                            \
+      return PT_WAITING;                                                      \
+    }                                                                         \
+  }                                                                           \
+  while (0)
+
+#define PT_YIELD(pt)                                                          \
+  do {                                                                        \
+    (pt)->lc = __LINE__;                                                      \
+    return PT_YIELDED;                                                        \
+  case __LINE__:                                                              \
+    ;                                                                         \
+  }                                                                           \
+  while (0)
+
+#define PT_SLEEP(pt, ms)                                                      \
+  do {                                                                        \
+    (pt)->wake = task_now() + TASK_MSEC_TO_TICKS(ms);                         \
+    (pt)->lc = __LINE__;                                                      \
+    return PT_SLEEPING;                                                       \
+  case __LINE__:                                                              \
+    ;                                                                         \
+  }                                                                           \
+  while (0)
+
+#if TASK_PT
+// Start running protothread function fn with state pt.
+// Call from main() or from a task (not from an interrupt handler).
+void task_pt_start(pt_t *pt, pt_fn fn);
+
+// Make the host poll waiting protothreads, after a change to the condition
+// they wait for. Without it, they are polled every TASK_PT_POLL_MS.
+// Call after task_init. May be called from interrupt handlers (see
+// task_wakeup_pending).
+void task_pt_poll(void);
+#endif
+
+#endif /* PT_H_ */
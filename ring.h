@@ -0,0 +1,132 @@
+#ifndef RING_H_
+#define RING_H_
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <stdint.h>
+
+#include "task.h"
+
+/*
+ * Single-producer/single-consumer ring buffer.
+ *
+ * RING_DECLARE(name, type, size) declares the type name_t and the functions
+ * name_init, name_count, name_push, name_pop, name_push_wait and
+ * name_pop_wait, for a ring buffer holding up to size elements of type.
+ *
+ * The producer only ever writes the head index and the consumer only ever
+ * writes the tail index. Both are single bytes, so they are read and written
+ * atomically on AVR and neither side has to disable interrupts. Either side
+ * may run in an interrupt handler, as long as there is one producer and one
+ * consumer. A handler that wakes up a blocked task doesn't switch to it; it
+ * can end with task_yield_pending to do so.
+ *
+ * The indices run freely and wrap at 256, so the size must be a power of two
+ * no larger than 128.
+ *
+ * The blocking variants suspend the calling task until there is an element
+ * (or space) and are woken up by the other side. They must not be used from
+ * an interrupt handler.
+ */
+
+/* Private macros. */
+#define RING_BARRIER() __asm__ __volatile__ ("" ::: "memory")
+
+// Wake up task pointed to by *w, if any.
+// The unprotected check keeps the common case (no waiter) free of cli.
+// Only switches to the woken up task if interrupts were enabled, so never in
+// the middle of an interrupt handler (see task_wakeup_pending).
+#define RING_WAKE(w)                                                          \
+  do {                                                                        \
+    if (*(w)) {                                                               \
+      uint8_t __sreg = SREG;                                                  \
+      task_t *__t;                                                            \
+      cli();                                                                  \
+      __t = *(w);                                                             \
+      *(w) = 0;                                                               \
+      if (__t) {                                                              \
+        task_wakeup_pending(__t);                                             \
+      }                                                                       \
+      SREG = __sreg;                                                          \
+      if (__sreg & _BV(SREG_I)) {                                             \
+        task_yield_pending();                                                 \
+      }                                                                       \
+    }                                                                         \
+  }                                                                           \
+  while (0)
+
+/* Public macros. */
+#define RING_DECLARE(name, type, size)                                        \
+  typedef char name##__size_check[                                            \
+    (((size) & ((size) - 1)) == 0 && (size) <= 128) ? 1 : -1];                \
+                                                                              \
+  typedef struct {                                                            \
+    type buf[size];                                                           \
+    volatile uint8_t head;                                                    \
+    volatile uint8_t tail;                                                    \
+    task_t *volatile producer;                                                \
+    task_t *volatile consumer;                                                \
+  } name##_t;                                                                 \
+                                                                              \
+  static inline void name##_init(name##_t *r) {                               \
+    r->head = 0;                                                              \
+    r->tail = 0;                                                              \
+    r->producer = 0;                                                          \
+    r->consumer = 0;                                                          \
+  }                                                                           \
+                                                                              \
+  static inline uint8_t name##_count(name##_t *r) {                           \
+    return (uint8_t) (r->head - r->tail);                                     \
+  }                                                                           \
+                                                                              \
+  /* Returns 0 if the ring is full. */                                        \
+  static inline uint8_t name##_push(name##_t *r, const type *v) {             \
+    uint8_t head = r->head;                                                   \
+    if ((uint8_t) (head - r->tail) == (size)) {                               \
+      return 0;                                                               \
+    }                                                                         \
+    r->buf[head & ((size) - 1)] = *v;                                         \
+    RING_BARRIER();                                                           \
+    r->head = head + 1;                                                       \
+    RING_WAKE(&r->consumer);                                                  \
+    return 1;                                                                 \
+  }                                                                           \
+                                                                              \
+  /* Returns 0 if the ring is empty. */                                       \
+  static inline uint8_t name##_pop(name##_t *r, type *v) {                    \
+    uint8_t tail = r->tail;                                                   \
+    if (r->head == tail) {                                                    \
+      return 0;                                                               \
+    }                                                                         \
+    *v = r->buf[tail & ((size) - 1)];                                         \
+    RING_BARRIER();                                                           \
+    r->tail = tail + 1;                                                       \
+    RING_WAKE(&r->producer);                                                  \
+    return 1;                                                                 \
+  }                                                                           \
+                                                                              \
+  static inline void name##_push_wait(name##_t *r, const type *v) {           \
+    while (!name##_push(r, v)) {                                              \
+      uint8_t __sreg = SREG;                                                  \
+      cli();                                                                  \
+      if (name##_count(r) == (size)) {                                        \
+        r->producer = task_current();                                         \
+        task_suspend(0);                                                      \
+      }                                                                       \
+      SREG = __sreg;                                                          \
+    }                                                                         \
+  }                                                                           \
+                                                                              \
+  static inline void name##_pop_wait(name##_t *r, type *v) {                  \
+    while (!name##_pop(r, v)) {                                               \
+      uint8_t __sreg = SREG;                                                  \
+      cli();                                                                  \
+      if (name##_count(r) == 0) {                                             \
+        r->consumer = task_current();                                         \
+        task_suspend(0);                                                      \
+      }                                                                       \
+      SREG = __sreg;                                                          \
+    }                                                                         \
+  }
+
+#endif /* RING_H_ */
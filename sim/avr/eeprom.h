@@ -0,0 +1,22 @@
+#ifndef _SIM_AVR_EEPROM_H
+#define _SIM_AVR_EEPROM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Host stand-in for <avr/eeprom.h>.
+// EEMEM variables are collected in a section of their own, which the
+// simulator erases at start and loads from and saves to SIM_EEPROM if set.
+// Writes take as long as they do on the device.
+
+#define EEMEM __attribute__((section("sim_eeprom")))
+
+uint8_t eeprom_read_byte(const uint8_t *p);
+uint16_t eeprom_read_word(const uint16_t *p);
+void eeprom_read_block(void *dst, const void *src, size_t n);
+
+void eeprom_update_byte(uint8_t *p, uint8_t value);
+void eeprom_update_word(uint16_t *p, uint16_t value);
+void eeprom_update_block(const void *src, void *dst, size_t n);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef _SIM_AVR_INTERRUPT_H
+#define _SIM_AVR_INTERRUPT_H
+
+#include <avr/io.h>
+
+// Host stand-in for <avr/interrupt.h>.
+// Interrupt handlers are plain functions, called by the simulator when their
+// interrupt is pending, enabled, and interrupts are globally enabled.
+
+#define ISR_BLOCK
+#define ISR_NOBLOCK
+#define ISR_NAKED
+#define ISR(vector, ...) void vector(void); void vector(void)
+
+void sim_sei(void);
+void sim_cli(void);
+
+#define sei() sim_sei()
+#define cli() sim_cli()
+
+#endif
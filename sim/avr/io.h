@@ -0,0 +1,220 @@
+#ifndef _SIM_AVR_IO_H
+#define _SIM_AVR_IO_H
+
+#include <stdint.h>
+
+/*
+ * Host stand-in for <avr/io.h> (ATmega32U4).
+ *
+ * Every I/O register is a byte in sim_io, at its data space address. Each
+ * access goes through sim_reg, which first brings the simulated peripherals
+ * up to date with the virtual clock and runs pending interrupt handlers.
+ * Writes are picked up by the next access of any register.
+ *
+ * Flag registers with write-one-to-clear bits (TIFR0) read back with an
+ * unused bit set, so that writing them is noticed even if the written value
+ * equals the flags. Don't read-modify-write them, which is wrong on the real
+ * processor as well.
+ */
+
+#define _BV(bit) (1 << (bit))
+
+#define RAMEND 0x0AFF
+
+volatile uint8_t *sim_reg(uint16_t addr);
+
+#define _SFR_MEM8(addr) (*sim_reg(addr))
+#define _SFR_MEM16(addr) (*(volatile uint16_t *)sim_reg(addr))
+
+// Ports
+#define PINB _SFR_MEM8(0x23)
+#define DDRB _SFR_MEM8(0x24)
+#define PORTB _SFR_MEM8(0x25)
+#define PINC _SFR_MEM8(0x26)
+#define DDRC _SFR_MEM8(0x27)
+#define PORTC _SFR_MEM8(0x28)
+#define PIND _SFR_MEM8(0x29)
+#define DDRD _SFR_MEM8(0x2A)
+#define PORTD _SFR_MEM8(0x2B)
+#define PINE _SFR_MEM8(0x2C)
+#define DDRE _SFR_MEM8(0x2D)
+#define PORTE _SFR_MEM8(0x2E)
+#define PINF _SFR_MEM8(0x2F)
+#define DDRF _SFR_MEM8(0x30)
+#define PORTF _SFR_MEM8(0x31)
+
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PB6 6
+#define PB7 7
+#define PC6 6
+#define PC7 7
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+#define PD7 7
+#define PE2 2
+#define PE6 6
+#define PF0 0
+#define PF1 1
+#define PF4 4
+#define PF5 5
+#define PF6 6
+#define PF7 7
+
+#define DDB0 0
+#define DDD5 5
+#define DDF4 4
+#define DDF5 5
+#define DDF6 6
+#define DDF7 7
+
+#define PINF4 4
+#define PINF5 5
+#define PINF6 6
+#define PINF7 7
+
+// General timer/counter control (prescaler reset only)
+#define GTCCR _SFR_MEM8(0x43)
+#define PSRSYNC 0
+#define TSM 7
+
+// Timer/Counter0
+#define TIFR0 _SFR_MEM8(0x35)
+#define TOV0 0
+#define OCF0A 1
+#define OCF0B 2
+
+#define TCCR0A _SFR_MEM8(0x44)
+#define WGM00 0
+#define WGM01 1
+
+#define TCCR0B _SFR_MEM8(0x45)
+#define CS00 0
+#define CS01 1
+#define CS02 2
+#define WGM02 3
+
+#define TCNT0 _SFR_MEM8(0x46)
+#define OCR0A _SFR_MEM8(0x47)
+#define OCR0B _SFR_MEM8(0x48)
+
+#define TIMSK0 _SFR_MEM8(0x6E)
+#define TOIE0 0
+#define OCIE0A 1
+#define OCIE0B 2
+
+// Timer/Counter1 (free running only)
+#define TCCR1A _SFR_MEM8(0x80)
+#define TCCR1B _SFR_MEM8(0x81)
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define TCNT1 _SFR_MEM16(0x84)
+
+// Timer/Counter4 (free running only, clocked from the PLL)
+#define TCCR4B _SFR_MEM8(0xC1)
+#define CS40 0
+#define CS41 1
+#define CS42 2
+#define CS43 3
+#define TCNT4 _SFR_MEM8(0xBE)
+#define TC4H _SFR_MEM8(0xBF)
+#define OCR4C _SFR_MEM8(0xD1)
+
+// PLL
+#define PLLCSR _SFR_MEM8(0x49)
+#define PLOCK 0
+#define PLLE 1
+#define PINDIV 4
+
+#define PLLFRQ _SFR_MEM8(0x52)
+#define PDIV0 0
+#define PDIV1 1
+#define PDIV2 2
+#define PDIV3 3
+#define PLLTM0 4
+#define PLLTM1 5
+
+// Sleep mode control
+#define SMCR _SFR_MEM8(0x53)
+#define SE 0
+#define SM0 1
+#define SM1 2
+#define SM2 3
+
+// Status register
+#define SREG _SFR_MEM8(0x5F)
+#define SREG_I 7
+
+// ADC
+#define ADC _SFR_MEM16(0x78)
+#define ADCW _SFR_MEM16(0x78)
+#define ADCL _SFR_MEM8(0x78)
+#define ADCH _SFR_MEM8(0x79)
+
+#define ADCSRA _SFR_MEM8(0x7A)
+#define ADPS0 0
+#define ADPS1 1
+#define ADPS2 2
+#define ADIE 3
+#define ADIF 4
+#define ADATE 5
+#define ADSC 6
+#define ADEN 7
+
+#define ADCSRB _SFR_MEM8(0x7B)
+#define ADTS0 0
+#define ADTS1 1
+#define ADTS2 2
+#define ADTS3 3
+#define MUX5 5
+
+#define ADMUX _SFR_MEM8(0x7C)
+#define MUX0 0
+#define MUX1 1
+#define MUX2 2
+#define MUX3 3
+#define MUX4 4
+#define ADLAR 5
+#define REFS0 6
+#define REFS1 7
+
+#define DIDR0 _SFR_MEM8(0x7E)
+
+// USART1 (transmitter only)
+#define UCSR1A _SFR_MEM8(0xC8)
+#define U2X1 1
+#define UDRE1 5
+#define TXC1 6
+
+#define UCSR1B _SFR_MEM8(0xC9)
+#define TXEN1 3
+#define UDRIE1 5
+
+#define UCSR1C _SFR_MEM8(0xCA)
+#define UCSZ10 1
+#define UCSZ11 2
+
+#define UBRR1 _SFR_MEM16(0xCC)
+#define UBRR1L _SFR_MEM8(0xCC)
+#define UBRR1H _SFR_MEM8(0xCD)
+#define UDR1 _SFR_MEM8(0xCE)
+
+// Interrupt vectors
+#define TIMER1_COMPA_vect __vector_17
+#define TIMER0_COMPA_vect __vector_21
+#define TIMER0_COMPB_vect __vector_22
+#define TIMER0_OVF_vect __vector_23
+#define USART1_UDRE_vect __vector_26
+#define ADC_vect __vector_29
+
+#endif
@@ -0,0 +1,233 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../task.h"
+#include "sim.h"
+
+/*
+ * Sweep benchmark.
+ *
+ * Selects every mode and band in turn by pressing the buttons, like a user
+ * would, and measures for each combination:
+ *
+ *   sweep_ms     Duration of a sweep (mean over BENCH_SWEEPS sweeps).
+ *   points       DDS frequencies set per sweep.
+ *   points_per_s Rate of the DDS, settle, and ADC pipeline.
+ *   adc_per_s    ADC conversions per second during a sweep.
+ *   wakeups      Times the sweep task was scheduled per sweep.
+ *   result_ms    Time from releasing the button until the LCD shows the
+ *                first result of a sweep that started after the release.
+ *   hz, vswr     Result of the first such sweep.
+ *   vswr_true    VSWR of the load at hz, according to the bridge model.
+ *
+ * The results are written to stdout as CSV. The virtual clock makes them
+ * exactly reproducible, so any difference from a previous run is caused by
+ * a change to the firmware or the model.
+ */
+
+#define BENCH_MODES 5
+#define BENCH_BANDS 10
+
+// Number of sweeps to average per combination.
+#define BENCH_SWEEPS 3
+
+// Give up on a combination after this many seconds.
+#define BENCH_TIMEOUT 60
+
+// Buttons (PF5 mode, PF4 band), and how long to hold and release them.
+#define BENCH_PORTF 4
+#define BENCH_MODE_BUTTON (1 << 5)
+#define BENCH_BAND_BUTTON (1 << 4)
+#define BENCH_PRESS_MS 50
+
+#define MS(ms) ((uint64_t)(ms) * (F_CPU / 1000))
+
+// Defined in main.c.
+extern uint8_t mode_index;
+extern uint8_t band_index;
+
+static enum {
+  BENCH_INIT,
+  BENCH_SELECT,
+  BENCH_PRESS,
+  BENCH_RELEASE,
+  BENCH_MEASURE,
+} state = BENCH_INIT;
+
+// Combination being measured.
+static uint8_t mode;
+static uint8_t band;
+
+// Time of the next state change (for pressing buttons) or the timeout.
+static uint64_t next;
+
+// Time the last button was released.
+static uint64_t selected;
+
+// Sweep in progress.
+static struct {
+  uint8_t mode;
+  uint8_t band;
+  uint64_t start;
+  uint32_t dds;
+  uint32_t adc;
+  uint16_t scheduled;
+} sweep;
+
+// Measurements for the current combination.
+static struct {
+  uint8_t sweeps;
+  uint64_t cycles;
+  uint32_t dds;
+  uint32_t adc;
+  uint32_t wakeups;
+  uint32_t hz;
+  uint16_t vswr;
+  uint64_t shown;
+} m;
+
+static void bench_row(void) {
+  double sec = (double)m.cycles / F_CPU;
+
+  printf("%u,%u,", mode, band);
+  if (m.sweeps == 0) {
+    printf(",,,,,,,,\n");
+    return;
+  }
+
+  printf(
+    "%.3f,%u,%.1f,%.1f,%u,",
+    1000 * sec / m.sweeps,
+    m.dds / m.sweeps,
+    m.dds / sec,
+    m.adc / sec,
+    m.wakeups / m.sweeps);
+
+  if (m.shown) {
+    printf("%.3f", 1000.0 * (m.shown - selected) / F_CPU);
+  }
+
+  printf(",%lu,%.3f,", (unsigned long)m.hz, m.vswr / 1000.0);
+  if (m.hz) {
+    printf("%.3f", sim_load_vswr(m.hz));
+  }
+  printf("\n");
+}
+
+// Move to the next combination. Exits after the last one.
+static void bench_next(void) {
+  if (++band == BENCH_BANDS) {
+    band = 0;
+    if (++mode == BENCH_MODES) {
+      exit(0);
+    }
+  }
+
+  state = BENCH_SELECT;
+}
+
+void sim_poll(void) {
+  if (sim_cycles < next && state != BENCH_MEASURE) {
+    return;
+  }
+
+  switch (state) {
+  case BENCH_INIT:
+    // Runs until the benchmark exits.
+    sim_end = UINT64_MAX;
+    printf("mode,band,sweep_ms,points,points_per_s,adc_per_s,wakeups,result_ms,hz,vswr,vswr_true\n");
+    state = BENCH_SELECT;
+    break;
+
+  case BENCH_SELECT:
+    // The first press after the LCD went idle only wakes it up, so keep
+    // pressing until the firmware has selected the combination.
+    if (mode_index != mode) {
+      sim_pin_low[BENCH_PORTF] = BENCH_MODE_BUTTON;
+    } else if (band_index != band) {
+      sim_pin_low[BENCH_PORTF] = BENCH_BAND_BUTTON;
+    } else {
+      m.sweeps = 0;
+      m.cycles = 0;
+      m.dds = 0;
+      m.adc = 0;
+      m.wakeups = 0;
+      m.shown = 0;
+      next = selected + MS(1000 * BENCH_TIMEOUT);
+      state = BENCH_MEASURE;
+      break;
+    }
+    next = sim_cycles + MS(BENCH_PRESS_MS);
+    state = BENCH_PRESS;
+    break;
+
+  case BENCH_PRESS:
+    sim_pin_low[BENCH_PORTF] = 0;
+    selected = sim_cycles;
+    next = sim_cycles + MS(BENCH_PRESS_MS);
+    state = BENCH_RELEASE;
+    break;
+
+  case BENCH_RELEASE:
+    state = BENCH_SELECT;
+    break;
+
+  case BENCH_MEASURE:
+    if ((m.sweeps >= BENCH_SWEEPS && m.shown) || sim_cycles >= next) {
+      bench_row();
+      bench_next();
+    }
+    break;
+  }
+}
+
+// Times the calling task was scheduled.
+static uint16_t bench_scheduled(void) {
+  task_stats_t s;
+
+  task_stats(task_current(), &s);
+  return s.scheduled;
+}
+
+// Called by the sweep task.
+void bench_sweep_start(uint8_t sweep_mode, uint8_t sweep_band) {
+  sweep.mode = sweep_mode;
+  sweep.band = sweep_band;
+  sweep.start = sim_cycles;
+  sweep.dds = sim_dds_updates;
+  sweep.adc = sim_adc_conversions;
+  sweep.scheduled = bench_scheduled();
+}
+
+// Called by the sweep task.
+void bench_sweep_done(uint32_t hz, uint16_t vswr) {
+  if (state != BENCH_MEASURE || sweep.start < selected) {
+    return;
+  }
+  if (sweep.mode != mode || sweep.band != band || m.sweeps == BENCH_SWEEPS) {
+    return;
+  }
+
+  if (m.sweeps == 0) {
+    m.hz = hz;
+    m.vswr = vswr;
+  }
+
+  m.sweeps++;
+  m.cycles += sim_cycles - sweep.start;
+  m.dds += sim_dds_updates - sweep.dds;
+  m.adc += sim_adc_conversions - sweep.adc;
+  m.wakeups += (uint16_t)(bench_scheduled() - sweep.scheduled);
+}
+
+void bench_result_shown(uint8_t mode_shown, uint32_t hz, uint16_t vswr) {
+  if (state != BENCH_MEASURE || m.sweeps == 0 || m.shown) {
+    return;
+  }
+
+  if (mode_shown == mode && hz == m.hz && vswr == m.vswr) {
+    m.shown = sim_cycles;
+  }
+}
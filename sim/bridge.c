@@ -0,0 +1,260 @@
+#include <complex.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sim.h"
+
+/*
+ * Model of the analyzer's resistive bridge and diode detectors.
+ *
+ * The DDS drives a bridge with 50 ohm arms. One side is a divider of two
+ * resistors, the other a resistor and the load. The forward detector (ADC6)
+ * sees the reference divider, i.e. half the drive voltage. The reverse
+ * detector (ADC7) sees the difference between both sides, which is the drive
+ * voltage times |G|/2, where G is the reflection coefficient of the load.
+ *
+ * A real bridge is not balanced at all frequencies: part of the drive leaks
+ * to the reverse detector (directivity) through stray capacitance, so it
+ * grows with frequency and is in quadrature with the drive, and the reverse
+ * path loses more than the forward path (tracking).
+ *
+ * The detectors are peak detectors with an RC filter: after the frequency
+ * changes, their outputs settle exponentially toward the new voltages. See
+ * sim.h for the parameters.
+ */
+
+#define BRIDGE_R 50.0
+#define BRIDGE_VREF 5.0 // AVcc (REFS0)
+#define BRIDGE_DDS_CLK 125e6
+
+// Frequency at which directivity and tracking are specified.
+#define BRIDGE_HZ_REF 30e6
+
+char sim_standard = 0;
+
+static struct {
+  double r, l, c; // Series RLC load.
+
+  double z0, len, vf, loss; // Transmission line, if len > 0.
+
+  double leak; // Directivity leakage at BRIDGE_HZ_REF.
+  double track; // Reverse to forward gain at BRIDGE_HZ_REF.
+
+  double vsrc;
+  double diode;
+  double tau; // Detector time constant, in cycles.
+  double noise;
+  double cpu_noise; // Only while the processor runs.
+  uint64_t seed;
+} bridge = {
+  .r = 50.0,
+  .l = 20e-6,
+  .c = 370e-12,
+  .track = 1.0,
+  .vsrc = 2.0,
+  .tau = 300e-6 * F_CPU,
+  .seed = 1,
+};
+
+// Detector state.
+static struct {
+  double v; // Output voltage.
+  uint64_t at; // Time of v, in cycles.
+  uint32_t hz; // Frequency the detector is settling toward.
+} detector[2];
+
+// Return the reflection coefficient of the load (through the line, if any)
+// relative to the bridge impedance.
+static double complex bridge_gamma(uint32_t hz) {
+  double w = 2 * M_PI * hz;
+  double complex z = bridge.r + I * w * bridge.l;
+  double complex g;
+
+  switch (sim_standard) {
+  case 'o':
+    return 1;
+  case 's':
+    return -1;
+  case 'l':
+    return 0;
+  }
+
+  if (bridge.c > 0) {
+    z += 1 / (I * w * bridge.c);
+  }
+
+  if (bridge.len > 0) {
+    // Transform the load's reflection coefficient along the line.
+    double beta = w / (bridge.vf * 299792458.0);
+    double alpha = bridge.loss * bridge.len / 20 * M_LN10;
+
+    g = (z - bridge.z0) / (z + bridge.z0);
+    g *= cexp(-2 * alpha - I * 2 * beta * bridge.len);
+    z = bridge.z0 * (1 + g) / (1 - g);
+  }
+
+  return (z - BRIDGE_R) / (z + BRIDGE_R);
+}
+
+double sim_load_vswr(uint32_t hz) {
+  double g;
+
+  if (sim_replay) {
+    return sim_replay_vswr(hz);
+  }
+
+  g = cabs(bridge_gamma(hz));
+
+  return (g >= 1) ? INFINITY : (1 + g) / (1 - g);
+}
+
+// Return the settled detector voltage for channel (0 forward, 1 reverse).
+static double bridge_voltage(int ch, uint32_t hz) {
+  double x = M_PI * hz / BRIDGE_DDS_CLK;
+  double v = bridge.vsrc / 2;
+  double d;
+
+  // The DDS output rolls off as sin(x)/x.
+  if (hz > 0) {
+    v *= sin(x) / x;
+  } else {
+    v = 0;
+  }
+
+  if (ch == 1) {
+    double f = hz / BRIDGE_HZ_REF;
+    double t = 1 + (bridge.track - 1) * f;
+
+    v *= cabs(t * bridge_gamma(hz) + I * bridge.leak * f);
+  }
+
+  d = v - bridge.diode;
+  return (d > 0) ? d : 0;
+}
+
+// Standard normal deviate (xorshift64 and Box-Muller).
+static double bridge_gauss(void) {
+  double u[2];
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    bridge.seed ^= bridge.seed << 13;
+    bridge.seed ^= bridge.seed >> 7;
+    bridge.seed ^= bridge.seed << 17;
+    u[i] = ((bridge.seed >> 11) + 0.5) / 9007199254740992.0;
+  }
+
+  return sqrt(-2 * log(u[0])) * cos(2 * M_PI * u[1]);
+}
+
+// Move detector output toward the voltage for hz, up to time t.
+static void bridge_settle(int ch, uint64_t t) {
+  double target = bridge_voltage(ch, detector[ch].hz);
+  double dt = t - detector[ch].at;
+
+  if (bridge.tau > 0) {
+    detector[ch].v = target + (detector[ch].v - target) * exp(-dt / bridge.tau);
+  } else {
+    detector[ch].v = target;
+  }
+
+  detector[ch].at = t;
+}
+
+uint16_t sim_adc_sample(uint8_t mux) {
+  int ch;
+  double counts;
+  double noise;
+
+  if (sim_replay) {
+    return sim_replay_sample(mux);
+  }
+
+  if (mux == 6) {
+    ch = 0;
+  } else if (mux == 7) {
+    ch = 1;
+  } else {
+    return 0;
+  }
+
+  // Settle toward the old frequency until the DDS was changed.
+  if (detector[ch].hz != sim_dds_hz) {
+    bridge_settle(ch, sim_dds_cycles);
+    detector[ch].hz = sim_dds_hz;
+  }
+
+  bridge_settle(ch, sim_cycles);
+
+  counts = detector[ch].v / BRIDGE_VREF * 1024;
+  noise = bridge.noise;
+  if (!sim_adc_quiet) {
+    noise = hypot(noise, bridge.cpu_noise);
+  }
+  if (noise > 0) {
+    counts += noise * bridge_gauss();
+  }
+
+  if (counts < 0) {
+    return 0;
+  }
+  if (counts > 1023) {
+    return 1023;
+  }
+  return (uint16_t)(counts + 0.5);
+}
+
+__attribute__((constructor))
+static void bridge_init(void) {
+  const char *s;
+
+  if ((s = getenv("SIM_LOAD")) != 0) {
+    if (sscanf(s, "%lf,%lf,%lf", &bridge.r, &bridge.l, &bridge.c) != 3) {
+      fprintf(stderr, "sim: SIM_LOAD must be \"R,L,C\"\n");
+      exit(1);
+    }
+  }
+
+  if ((s = getenv("SIM_LINE")) != 0) {
+    if (sscanf(s, "%lf,%lf,%lf,%lf", &bridge.z0, &bridge.len, &bridge.vf, &bridge.loss) != 4) {
+      fprintf(stderr, "sim: SIM_LINE must be \"Z0,length,vf,loss\"\n");
+      exit(1);
+    }
+  }
+
+  if ((s = getenv("SIM_BRIDGE")) != 0) {
+    double directivity;
+    double tracking;
+
+    if (sscanf(s, "%lf,%lf", &directivity, &tracking) != 2) {
+      fprintf(stderr, "sim: SIM_BRIDGE must be \"directivity,tracking\"\n");
+      exit(1);
+    }
+    bridge.leak = pow(10, -directivity / 20);
+    bridge.track = pow(10, -tracking / 20);
+  }
+
+  if ((s = getenv("SIM_VSRC")) != 0) {
+    bridge.vsrc = atof(s);
+  }
+  if ((s = getenv("SIM_DIODE")) != 0) {
+    bridge.diode = atof(s);
+  }
+  if ((s = getenv("SIM_SETTLE")) != 0) {
+    bridge.tau = atof(s) * 1e-6 * F_CPU;
+  }
+  if ((s = getenv("SIM_NOISE")) != 0) {
+    bridge.noise = atof(s);
+  }
+  if ((s = getenv("SIM_CPU_NOISE")) != 0) {
+    bridge.cpu_noise = atof(s);
+  }
+  if ((s = getenv("SIM_SEED")) != 0) {
+    bridge.seed = strtoull(s, 0, 0);
+    if (bridge.seed == 0) {
+      bridge.seed = 1;
+    }
+  }
+}
@@ -0,0 +1,128 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+
+/*
+ * Calibration of the simulated bridge.
+ *
+ * Selects calibration mode with the mode button, then connects every
+ * standard the LCD asks for and confirms it with the band button, like a
+ * user would. Exits once the LCD shows that calibration is complete.
+ *
+ * Run with SIM_EEPROM set to keep the calibration for later runs of
+ * sim/main or sim/bench, with the same bridge (SIM_BRIDGE).
+ */
+
+#define CALIBRATE_MODE 5
+
+// Give up after this many seconds.
+#define CALIBRATE_TIMEOUT 120
+
+// Buttons (PF5 mode, PF4 band), and how long to hold and release them.
+#define CALIBRATE_PORTF 4
+#define CALIBRATE_MODE_BUTTON (1 << 5)
+#define CALIBRATE_BAND_BUTTON (1 << 4)
+#define CALIBRATE_PRESS_MS 50
+
+#define MS(ms) ((uint64_t)(ms) * (F_CPU / 1000))
+
+// Defined in main.c.
+extern uint8_t mode_index;
+
+static enum {
+  CALIBRATE_INIT,
+  CALIBRATE_SELECT,
+  CALIBRATE_PRESS,
+  CALIBRATE_RELEASE,
+  CALIBRATE_WAIT,
+} state = CALIBRATE_INIT;
+
+// State to return to after a button was pressed and released.
+static int after;
+
+// Time of the next state change.
+static uint64_t next;
+
+// Standard connected last.
+static char connected;
+
+static void calibrate_press(uint8_t button, int then) {
+  sim_pin_low[CALIBRATE_PORTF] = button;
+  next = sim_cycles + MS(CALIBRATE_PRESS_MS);
+  after = then;
+  state = CALIBRATE_PRESS;
+}
+
+// Return the standard the LCD asks for, 0 if none, or 'd' when done.
+static char calibrate_prompt(void) {
+  const char *row = sim_lcd_row(0);
+
+  if (strncmp(row, "Connect open ", 13) == 0) {
+    return 'o';
+  }
+  if (strncmp(row, "Connect short ", 14) == 0) {
+    return 's';
+  }
+  if (strncmp(row, "Connect load ", 13) == 0) {
+    return 'l';
+  }
+  if (strncmp(row, "Calibrated ", 11) == 0) {
+    return 'd';
+  }
+  return 0;
+}
+
+void sim_poll(void) {
+  char prompt;
+
+  if (sim_cycles >= MS(1000 * CALIBRATE_TIMEOUT)) {
+    fprintf(stderr, "calibrate: timed out\n");
+    exit(1);
+  }
+
+  if (sim_cycles < next) {
+    return;
+  }
+
+  switch (state) {
+  case CALIBRATE_INIT:
+    // Runs until calibration completes.
+    sim_end = UINT64_MAX;
+    state = CALIBRATE_SELECT;
+    break;
+
+  case CALIBRATE_SELECT:
+    // The first press after the LCD went idle only wakes it up.
+    if (mode_index != CALIBRATE_MODE) {
+      calibrate_press(CALIBRATE_MODE_BUTTON, CALIBRATE_SELECT);
+    } else {
+      state = CALIBRATE_WAIT;
+    }
+    break;
+
+  case CALIBRATE_PRESS:
+    sim_pin_low[CALIBRATE_PORTF] = 0;
+    next = sim_cycles + MS(CALIBRATE_PRESS_MS);
+    state = CALIBRATE_RELEASE;
+    break;
+
+  case CALIBRATE_RELEASE:
+    state = after;
+    break;
+
+  case CALIBRATE_WAIT:
+    prompt = calibrate_prompt();
+    if (prompt == 'd') {
+      printf("calibrate: done after %.3f s\n", (double)sim_cycles / F_CPU);
+      exit(0);
+    }
+    if (prompt != 0 && prompt != connected) {
+      sim_standard = connected = prompt;
+      calibrate_press(CALIBRATE_BAND_BUTTON, CALIBRATE_WAIT);
+    }
+    break;
+  }
+}
@@ -0,0 +1,250 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../capture.h"
+#include "sim.h"
+
+/*
+ * Replay of a capture (see capture.h) in place of the bridge model.
+ *
+ * While the firmware asks for the same frequencies and channels as the
+ * captured sweeps, it gets the captured counts in order, so unchanged sweep
+ * code reproduces the captured results exactly. When it asks for something
+ * else, replay moves on to the next captured point at that frequency, and if
+ * there is none, interpolates between the mean counts of the neighbouring
+ * captured frequencies. Only the samples with the longest settle time at a
+ * frequency count toward its mean.
+ *
+ * The firmware starts in the mode and band of the first captured sweep.
+ */
+
+int sim_replay = 0;
+
+// Captured samples, in order.
+static struct replay_sample {
+  uint32_t hz;
+  uint8_t ch; // 0 is forward (ADC6), 1 is reverse (ADC7).
+  uint8_t first; // Set on the first sample after the frequency was set.
+  uint16_t count;
+} *samples;
+
+static size_t nsamples;
+static size_t maxsamples;
+static size_t pos;
+
+// Mean counts per frequency, sorted by frequency.
+static struct replay_point {
+  uint32_t hz;
+  uint16_t settle_us;
+  double sum[2];
+  uint32_t n[2];
+} *points;
+
+static size_t npoints;
+
+// Defined in main.c.
+extern uint8_t mode_index;
+extern uint8_t band_index;
+
+static int replay_match(size_t i, uint32_t hz, uint8_t ch) {
+  return samples[i].hz == hz && samples[i].ch == ch;
+}
+
+// Return mean count of channel ch at hz, interpolating between points.
+static double replay_mean(uint8_t ch, uint32_t hz) {
+  struct replay_point *lo = 0;
+  struct replay_point *hi = 0;
+  size_t i;
+
+  for (i = 0; i < npoints; i++) {
+    if (points[i].n[ch] == 0) {
+      continue;
+    }
+    if (points[i].hz <= hz) {
+      lo = &points[i];
+    } else {
+      hi = &points[i];
+      break;
+    }
+  }
+
+  if (lo == 0 && hi == 0) {
+    return 0;
+  }
+  if (lo == 0) {
+    return hi->sum[ch] / hi->n[ch];
+  }
+  if (hi == 0 || lo->hz == hz) {
+    return lo->sum[ch] / lo->n[ch];
+  }
+
+  return lo->sum[ch] / lo->n[ch] +
+    (hi->sum[ch] / hi->n[ch] - lo->sum[ch] / lo->n[ch]) *
+    (double)(hz - lo->hz) / (hi->hz - lo->hz);
+}
+
+uint16_t sim_replay_sample(uint8_t mux) {
+  uint32_t hz = sim_dds_hz;
+  uint8_t ch;
+  size_t i;
+
+  if (mux == 6) {
+    ch = 0;
+  } else if (mux == 7) {
+    ch = 1;
+  } else {
+    return 0;
+  }
+
+  if (nsamples == 0) {
+    return 0;
+  }
+
+  if (pos == nsamples) {
+    pos = 0;
+  }
+
+  // Next captured sample, or the start of the next point at this frequency.
+  if (!replay_match(pos, hz, ch)) {
+    for (i = 1; i < nsamples; i++) {
+      size_t j = (pos + i) % nsamples;
+      if (samples[j].first && replay_match(j, hz, ch)) {
+        break;
+      }
+    }
+    if (i == nsamples) {
+      return (uint16_t)(replay_mean(ch, hz) + 0.5);
+    }
+    pos = (pos + i) % nsamples;
+  }
+
+  return samples[pos++].count;
+}
+
+double sim_replay_vswr(uint32_t hz) {
+  double fwd = replay_mean(0, hz);
+  double rev = replay_mean(1, hz);
+
+  return (rev >= fwd) ? INFINITY : (fwd + rev) / (fwd - rev);
+}
+
+static void replay_fatal(const char *path, const char *msg) {
+  fprintf(stderr, "sim: %s: %s\n", path, msg);
+  exit(1);
+}
+
+static void replay_point(uint32_t hz, uint16_t settle_us, uint8_t ch, uint16_t count) {
+  struct replay_point *p;
+  size_t i;
+
+  for (i = 0; i < npoints && points[i].hz < hz; i++) {
+  }
+
+  if (i == npoints || points[i].hz != hz) {
+    points = realloc(points, (npoints + 1) * sizeof(*points));
+    if (points == 0) {
+      replay_fatal("replay", "out of memory");
+    }
+    for (size_t j = npoints; j > i; j--) {
+      points[j] = points[j - 1];
+    }
+    npoints++;
+    points[i] = (struct replay_point){ .hz = hz, .settle_us = settle_us };
+  }
+
+  p = &points[i];
+  if (settle_us < p->settle_us) {
+    return;
+  }
+  if (settle_us > p->settle_us) {
+    *p = (struct replay_point){ .hz = hz, .settle_us = settle_us };
+  }
+
+  p->sum[ch] += count;
+  p->n[ch]++;
+}
+
+static void replay_load(const char *path) {
+  FILE *f = fopen(path, "rb");
+  uint32_t hz = 0;
+  uint16_t settle_us = 0;
+  uint8_t first = 0;
+  int sweeps = 0;
+  int c;
+
+  if (f == 0) {
+    perror(path);
+    exit(1);
+  }
+
+  while ((c = fgetc(f)) != EOF) {
+    uint8_t b[6];
+    size_t n = 0;
+
+    if (c == CAPTURE_SWEEP) {
+      n = 2;
+    } else if (c == CAPTURE_FREQ) {
+      n = 6;
+    } else if (c < 0x20) {
+      n = 1;
+    } else {
+      replay_fatal(path, "bad record");
+    }
+
+    if (fread(b, 1, n, f) != n) {
+      replay_fatal(path, "truncated record");
+    }
+
+    if (c == CAPTURE_SWEEP) {
+      if (sweeps++ == 0) {
+        mode_index = b[0];
+        band_index = b[1];
+      }
+    } else if (c == CAPTURE_FREQ) {
+      hz = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+      settle_us = b[4] | (b[5] << 8);
+      first = 1;
+    } else {
+      uint8_t mux = c >> 2;
+      uint16_t count = ((c & 3) << 8) | b[0];
+
+      if (mux != 6 && mux != 7) {
+        continue;
+      }
+
+      if (nsamples == maxsamples) {
+        maxsamples = maxsamples ? 2 * maxsamples : 1024;
+        samples = realloc(samples, maxsamples * sizeof(*samples));
+        if (samples == 0) {
+          replay_fatal(path, "out of memory");
+        }
+      }
+      samples[nsamples++] = (struct replay_sample){
+        .hz = hz,
+        .ch = mux - 6,
+        .first = first,
+        .count = count,
+      };
+      replay_point(hz, settle_us, mux - 6, count);
+      first = 0;
+    }
+  }
+
+  fclose(f);
+
+  if (nsamples == 0) {
+    replay_fatal(path, "no samples");
+  }
+}
+
+__attribute__((constructor))
+static void replay_init(void) {
+  const char *s;
+
+  if ((s = getenv("SIM_REPLAY")) != 0) {
+    replay_load(s);
+    sim_replay = 1;
+  }
+}
@@ -0,0 +1,1084 @@
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <util/delay_basic.h>
+
+#include "../task.h"
+#include "sim.h"
+
+#if TASK_PT
+#include "../pt.h"
+#endif
+
+/*
+ * Scheduler checks and tick benchmark.
+ *
+ * Runs the scheduler without the analyzer firmware. A driver task runs the
+ * checks one after another, creating the tasks each check needs, and prints
+ * one line per check. Exits with status 1 if a check fails or doesn't finish
+ * in time.
+ *
+ * The tick benchmark measures the host time of the timer interrupts that
+ * wake the idle processor, with 2 to 16 tasks sleeping. The delta list keeps
+ * it independent of the number of sleeping tasks. The numbers depend on the
+ * host; compare them between runs on the same machine.
+ */
+
+// Give up on a check after this many seconds.
+#define SCHED_TIMEOUT 300
+
+// Stack size of the tasks the checks create. The simulator runs them on
+// host stacks, so this only takes up simulated RAM.
+#define SCHED_STACK_SIZE 0x20
+
+// Largest number of tasks sleeping during the tick benchmark.
+#define SCHED_TICK_TASKS 16
+
+// Length of each tick benchmark run, in milliseconds.
+#define SCHED_TICK_MS 8000
+
+// Length of the drift check, in milliseconds, and the largest error of the
+// task clock it accepts, in microseconds. The error is measured to within a
+// timer count (US_PER_COUNT).
+#define SCHED_DRIFT_MS 10000
+#define SCHED_DRIFT_US 100
+
+// Longest wait of the task_usleep check, in microseconds, and the number of
+// random timer phases to try every wait at. Covers waits that end in the
+// next tick, and in the one after.
+#define SCHED_USLEEP_MAX (2 * 1000 * MS_PER_TICK + 200)
+#define SCHED_USLEEP_PHASES 8
+
+#define MS(ms) ((uint64_t)(ms) * (F_CPU / 1000))
+
+// Check that is running, and the time it has to finish by.
+static const char *check = "start";
+static uint64_t deadline = MS(1000 * SCHED_TIMEOUT);
+
+static uint8_t failures = 0;
+
+// Defined in main.c, which isn't linked in. Set by replay.c.
+uint8_t mode_index;
+uint8_t band_index;
+
+// Set to make the tasks of a check stop.
+static volatile uint8_t stop;
+
+static volatile uint16_t wakes;
+
+// ADC interrupt handler of the check that is running.
+static void (*sched_adc_isr)(void);
+
+// Set while the handler runs.
+static volatile uint8_t sched_in_isr;
+
+ISR(ADC_vect) {
+  sched_in_isr = 1;
+  sched_adc_isr();
+}
+
+void sim_poll(void) {
+  if (sim_cycles >= deadline) {
+    printf("%s: timed out\n", check);
+    exit(1);
+  }
+}
+
+static void sched_begin(const char *name) {
+  check = name;
+  deadline = sim_cycles + MS(1000 * SCHED_TIMEOUT);
+  stop = 0;
+}
+
+static void sched_result(uint8_t ok, const char *detail) {
+  printf("%s: %s, %s\n", check, ok ? "ok" : "FAILED", detail);
+  if (!ok) {
+    failures++;
+  }
+}
+
+//
+// A task that keeps sleeping for 0 ticks must not hold up other sleepers.
+//
+
+static void sched_sleep0_spin(void *data) {
+  while (!stop) {
+    task_sleep(0);
+  }
+
+  task_suspend(0);
+}
+
+static void sched_sleep0_sleeper(void *data) {
+  while (!stop) {
+    task_sleep(20);
+    wakes++;
+  }
+
+  task_suspend(0);
+}
+
+static void sched_sleep0(void) {
+  char detail[64];
+
+  sched_begin("sleep0");
+  wakes = 0;
+  task_create_ex(sched_sleep0_spin, 0, SCHED_STACK_SIZE);
+  task_create_ex(sched_sleep0_sleeper, 0, SCHED_STACK_SIZE);
+
+  task_sleep(200);
+  stop = 1;
+
+  snprintf(detail, sizeof(detail), "20 ms sleeper woke %u times in 200 ms", wakes);
+  sched_result(wakes >= 9, detail);
+  task_sleep(40);
+}
+
+#if TASK_TICKLESS
+//
+// With nothing else to do, a sleep of several ticks wakes the processor once
+// per stretched timer period instead of on every tick.
+//
+
+#define SCHED_TICKLESS_MS 20
+#define SCHED_TICKLESS_ROUNDS 100
+
+static void sched_tickless(void) {
+  char detail[64];
+  uint32_t interrupts;
+  uint16_t i;
+
+  // Regular ticks of the sleep, and the most wakeups it may take: one per
+  // full stretched period, then the rest of the ticks one by one.
+  const uint16_t ticks = TASK_MSEC_TO_TICKS(SCHED_TICKLESS_MS);
+  const uint16_t most =
+    ticks / (TICKLESS_RATIO * TICKLESS_MAX_PERIODS) + ticks % (TICKLESS_RATIO * TICKLESS_MAX_PERIODS);
+
+  sched_begin("tickless");
+  task_sleep(0);
+  interrupts = sim_wakes;
+  for (i = 0; i < SCHED_TICKLESS_ROUNDS; i++) {
+    task_sleep(SCHED_TICKLESS_MS);
+  }
+  interrupts = sim_wakes - interrupts;
+
+  snprintf(
+    detail,
+    sizeof(detail),
+    "%u ms sleep woke the processor %.1f times, %u ticks",
+    SCHED_TICKLESS_MS,
+    (double)interrupts / SCHED_TICKLESS_ROUNDS,
+    ticks);
+  sched_result(interrupts <= (uint32_t)most * SCHED_TICKLESS_ROUNDS, detail);
+}
+#endif
+
+//
+// Host time per tick interrupt as the number of sleeping tasks grows.
+//
+
+static void sched_tick_sleeper(void *data) {
+  // Different deadlines, so that sleeping walks the delta list.
+  uint16_t ms = 60000 - 100 * (uintptr_t)data;
+
+  for (;;) {
+    task_sleep(ms);
+  }
+}
+
+static void sched_tick(void) {
+  char detail[96];
+  uint8_t n = 0;
+  uint8_t want;
+  uint64_t ns;
+  uint32_t interrupts;
+  uint32_t ticks;
+
+  for (want = 2; want <= SCHED_TICK_TASKS; want *= 2) {
+    sched_begin("tick");
+    for (; n < want; n++) {
+      task_create_ex(sched_tick_sleeper, (void *)(uintptr_t)n, SCHED_STACK_SIZE);
+    }
+
+    // Let them go to sleep.
+    task_sleep(10);
+
+    ns = sim_wake_ns;
+    interrupts = sim_wakes;
+    ticks = task_now();
+    task_sleep(SCHED_TICK_MS);
+    ns = sim_wake_ns - ns;
+    interrupts = sim_wakes - interrupts;
+    ticks = task_now() - ticks;
+
+    snprintf(
+      detail,
+      sizeof(detail),
+      "%2u tasks sleeping: %.0f ns per interrupt, %.1f ticks each",
+      n,
+      (double)ns / interrupts,
+      (double)ticks / interrupts);
+    sched_result(1, detail);
+  }
+}
+
+//
+// The clock must keep time while other interrupts wake the processor up in
+// the middle of stretched timer periods.
+//
+
+static QUEUE sched_adc_waiters = { &sched_adc_waiters, &sched_adc_waiters };
+
+static void sched_drift_isr(void) {
+  sched_in_isr = 0;
+  task_wake_one_from_isr(&sched_adc_waiters);
+}
+
+// Converts over and over, with a varying pause in between.
+static void sched_drift_adc(void *data) {
+  uint16_t pause = 1;
+
+  ADCSRA = _BV(ADEN) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+  while (!stop) {
+    cli();
+    ADCSRA |= _BV(ADSC);
+    task_wait(&sched_adc_waiters, 0);
+    sei();
+
+    pause = (pause * 75 + 74) % 65537;
+    _delay_loop_2(pause % 4096);
+    task_sleep(2 * (pause % 16));
+  }
+
+  ADCSRA = 0;
+  task_suspend(0);
+}
+
+// Return how far the task clock is ahead of the virtual clock, in cycles.
+// Called right after a tick, so no tick interrupt is pending.
+static int64_t sched_clock_error(void) {
+  int64_t t;
+
+  cli();
+  t = ((int64_t)task_now() * COUNTS_PER_TICK + TCNT0) * (F_CPU / 1000000) * US_PER_COUNT;
+  t -= sim_cycles;
+  sei();
+
+  return t;
+}
+
+static void sched_drift(void) {
+  char detail[96];
+  int64_t before;
+  double us;
+
+  sched_begin("drift");
+  sched_adc_isr = sched_drift_isr;
+  task_create_ex(sched_drift_adc, 0, SCHED_STACK_SIZE);
+
+  task_sleep(10);
+  before = sched_clock_error();
+  task_sleep(SCHED_DRIFT_MS);
+  us = (double)(sched_clock_error() - before) / (F_CPU / 1000000);
+  stop = 1;
+
+  snprintf(detail, sizeof(detail), "task clock off by %+.0f us after %u ms", us, SCHED_DRIFT_MS);
+  sched_result(us > -SCHED_DRIFT_US && us < SCHED_DRIFT_US, detail);
+  task_sleep(40);
+}
+
+#if TASK_SLEEP_ADC
+//
+// The clock must keep time while the processor sleeps in ADC Noise Reduction
+// mode, which stops TIMER0 until the conversion completes.
+//
+
+static void sched_adc_sleep_isr(void) {
+  sched_in_isr = 0;
+  task_wake_one_from_isr(&sched_adc_waiters);
+}
+
+static void sched_adc_sleep(void) {
+  char detail[96];
+  uint16_t pause = 1;
+  uint32_t start;
+  uint32_t sleeps = 0;
+  int64_t before;
+  double us;
+
+  sched_begin("adc_sleep");
+  sched_adc_isr = sched_adc_sleep_isr;
+  ADCSRA = _BV(ADEN) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+
+  task_sleep(10);
+  before = sched_clock_error();
+  start = task_now();
+
+  // Every time nothing else is runnable, the scheduler starts a conversion
+  // and sleeps until it completes.
+  task_sleep_adc(1);
+  while (task_now() - start < TASK_MSEC_TO_TICKS(SCHED_DRIFT_MS)) {
+    cli();
+    task_wait(&sched_adc_waiters, 0);
+    sei();
+    sleeps++;
+
+    // Run for a varying while, up to 1024 loops of 4 cycles.
+    pause = (pause * 75 + 74) % 65537;
+    _delay_loop_2(1 + pause % 1024);
+  }
+  task_sleep_adc(0);
+  ADCSRA = 0;
+
+  task_sleep(10);
+  us = (double)(sched_clock_error() - before) / (F_CPU / 1000000);
+
+  snprintf(detail, sizeof(detail), "task clock off by %+.0f us after %lu sleeps", us, (unsigned long)sleeps);
+  sched_result(us > -SCHED_DRIFT_US && us < SCHED_DRIFT_US, detail);
+}
+#endif
+
+#if TASK_STATS
+//
+// A task that only sleeps is never preempted, even when the processor is
+// idle on the ticks in between.
+//
+
+static void sched_stats_sleeper(void *data) {
+  while (!stop) {
+    task_sleep(10);
+  }
+
+  task_suspend(0);
+}
+
+static void sched_stats(void) {
+  char detail[64];
+  task_stats_t stats;
+  task_t *t;
+
+  sched_begin("stats");
+  t = task_create_ex(sched_stats_sleeper, 0, SCHED_STACK_SIZE);
+
+  task_sleep(200);
+  task_stats(t, &stats);
+  stop = 1;
+
+  snprintf(detail, sizeof(detail), "preempted %u times, yielded %u times", stats.preempted, stats.yielded);
+  sched_result(stats.preempted == 0 && stats.yielded >= 19, detail);
+  task_sleep(20);
+}
+#endif
+
+//
+// task_usleep must never return early, whatever the phase of the timer.
+//
+
+static void sched_usleep(void) {
+  char detail[96];
+  uint16_t us;
+  uint16_t early = 0;
+  uint16_t phase = 1;
+  uint8_t i;
+  uint64_t start;
+  uint64_t late;
+  uint64_t latest = 0;
+
+  sched_begin("usleep");
+  for (us = TASK_BUSY_USEC; us <= SCHED_USLEEP_MAX; us++) {
+    for (i = 0; i < SCHED_USLEEP_PHASES; i++) {
+      // Start somewhere within a tick.
+      task_sleep(0);
+      phase = (phase * 75 + 74) % 65537;
+      _delay_loop_2(phase % (F_CPU / 1000 * MS_PER_TICK / 4));
+
+      start = sim_cycles;
+      task_usleep(us);
+      if (sim_cycles - start < (uint64_t)us * (F_CPU / 1000000)) {
+        if (!early) {
+          early = us;
+        }
+        continue;
+      }
+
+      late = sim_cycles - start - (uint64_t)us * (F_CPU / 1000000);
+      if (late > latest) {
+        latest = late;
+      }
+    }
+  }
+
+  if (early) {
+    snprintf(detail, sizeof(detail), "returned early from a wait of %u us", early);
+  } else {
+    snprintf(
+      detail,
+      sizeof(detail),
+      "%u to %u us, at most %.1f us late",
+      TASK_BUSY_USEC,
+      SCHED_USLEEP_MAX,
+      (double)latest / (F_CPU / 1000000));
+  }
+  sched_result(!early, detail);
+}
+
+//
+// Several tasks can wait in task_usleep at the same time, each for its own
+// time.
+//
+
+#define SCHED_USLEEP_TASKS 3
+#define SCHED_USLEEP_ROUNDS 200
+
+static volatile uint16_t sched_usleep_early;
+static volatile uint64_t sched_usleep_latest;
+static volatile uint8_t sched_usleep_done;
+
+// Waits over and over, recording how early or late each wait ends.
+static void sched_usleep_run(uint8_t n) {
+  // 37 us like an LCD command, and longer waits that span ticks.
+  uint16_t us = 37 + 700 * n;
+  uint64_t start;
+  uint64_t late;
+  uint16_t i;
+
+  for (i = 0; i < SCHED_USLEEP_ROUNDS; i++) {
+    start = sim_cycles;
+    task_usleep(us);
+    if (sim_cycles - start < (uint64_t)us * (F_CPU / 1000000)) {
+      sched_usleep_early++;
+      continue;
+    }
+
+    late = sim_cycles - start - (uint64_t)us * (F_CPU / 1000000);
+    if (late > sched_usleep_latest) {
+      sched_usleep_latest = late;
+    }
+  }
+
+  sched_usleep_done++;
+}
+
+static void sched_usleep_sleeper(void *data) {
+  sched_usleep_run((uintptr_t)data);
+  task_suspend(0);
+}
+
+static void sched_usleep_many(void) {
+  char detail[96];
+  uint8_t i;
+
+  sched_begin("usleep_many");
+  sched_usleep_early = 0;
+  sched_usleep_latest = 0;
+  sched_usleep_done = 0;
+  // The driver is one of them.
+  for (i = 1; i < SCHED_USLEEP_TASKS; i++) {
+    task_create_ex(sched_usleep_sleeper, (void *)(uintptr_t)i, SCHED_STACK_SIZE);
+  }
+
+  sched_usleep_run(0);
+  while (sched_usleep_done < SCHED_USLEEP_TASKS) {
+    task_sleep(10);
+  }
+
+  snprintf(
+    detail,
+    sizeof(detail),
+    "%u tasks, %u early, at most %.1f us late",
+    SCHED_USLEEP_TASKS,
+    sched_usleep_early,
+    (double)sched_usleep_latest / (F_CPU / 1000000));
+  sched_result(!sched_usleep_early && sched_usleep_latest < MS(1) / 10, detail);
+}
+
+//
+// A periodic task that advances its deadline by its period doesn't drift,
+// however long it runs in between, and resumes right after each deadline.
+//
+
+#define SCHED_PERIOD_MS 20
+#define SCHED_PERIOD_ROUNDS 100
+
+static void sched_period(void) {
+  char detail[96];
+  uint32_t deadline;
+  uint16_t jitter;
+  uint16_t worst = 0;
+  uint16_t missed = 0;
+  uint16_t pause = 1;
+  uint16_t i;
+
+  sched_begin("period");
+  task_sleep(0);
+  deadline = task_now();
+  for (i = 0; i < SCHED_PERIOD_ROUNDS; i++) {
+    // Work for up to half the period.
+    pause = (pause * 75 + 74) % 65537;
+    _delay_loop_2(pause % (F_CPU / 1000 * SCHED_PERIOD_MS / 8));
+
+    deadline += TASK_MSEC_TO_TICKS(SCHED_PERIOD_MS);
+    jitter = task_sleep_until(deadline);
+    if (task_now() != deadline) {
+      missed++;
+    }
+    if (jitter > worst) {
+      worst = jitter;
+    }
+  }
+
+  snprintf(
+    detail,
+    sizeof(detail),
+    "%u of %u deadlines missed, at most %u us late",
+    missed,
+    SCHED_PERIOD_ROUNDS,
+    worst);
+  sched_result(!missed && worst < US_PER_TICK, detail);
+}
+
+//
+// A message posted from an interrupt handler reaches a waiting task with a
+// higher priority once the handler returns, not in the middle of it.
+//
+
+#define SCHED_MBOX_ROUNDS 200
+
+TASK_MBOX_DEFINE(sched_messages, uint16_t, 4);
+
+static void sched_mbox_isr(void) {
+  uint16_t n = sim_adc_conversions;
+
+  task_mbox_post(&sched_messages, &n);
+  sched_in_isr = 0;
+
+  task_yield_pending();
+}
+
+// Starts a conversion and busy waits past its end, over and over.
+static void sched_mbox_trigger(void *data) {
+  while (!stop) {
+    ADCSRA |= _BV(ADSC);
+    _delay_loop_2(1000);
+  }
+
+  task_suspend(0);
+}
+
+static void sched_mbox(void) {
+  char detail[96];
+  uint16_t misplaced = 0;
+  uint16_t left = 0;
+  uint16_t i;
+  uint16_t n;
+
+  sched_begin("mbox");
+  sched_adc_isr = sched_mbox_isr;
+  ADCSRA = _BV(ADEN) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+  task_create_ex(sched_mbox_trigger, 0, SCHED_STACK_SIZE);
+
+  for (i = 0; i < SCHED_MBOX_ROUNDS; i++) {
+    task_mbox_receive(&sched_messages, &n);
+    if (sched_in_isr) {
+      misplaced++;
+    }
+  }
+
+  // Let the mailbox fill up, then take what it holds.
+  task_sleep(10);
+  stop = 1;
+  ADCSRA = 0;
+  task_sleep(10);
+  while (task_mbox_try_receive(&sched_messages, &n)) {
+    left++;
+  }
+
+  snprintf(
+    detail,
+    sizeof(detail),
+    "%u of %u messages received inside the handler, %u left over",
+    misplaced,
+    SCHED_MBOX_ROUNDS,
+    left);
+  sched_result(!misplaced && left == 4 && !sched_messages.count, detail);
+}
+
+//
+// task_wake_one called in the middle of an interrupt handler doesn't switch
+// to the woken up task before the handler returns. task_create_prio rejects
+// priorities that don't exist.
+//
+
+#define SCHED_WAKEUP_ROUNDS 200
+
+static QUEUE sched_wakeup_waiters = { &sched_wakeup_waiters, &sched_wakeup_waiters };
+
+static void sched_wakeup_isr(void) {
+  task_wake_one(&sched_wakeup_waiters);
+  sched_in_isr = 0;
+
+  task_yield_pending();
+}
+
+static void sched_wakeup(void) {
+  char detail[96];
+  uint16_t misplaced = 0;
+  uint16_t woken = 0;
+  uint16_t i;
+  task_t *t;
+
+  sched_begin("wakeup");
+  sched_adc_isr = sched_wakeup_isr;
+  ADCSRA = _BV(ADEN) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+  task_create_ex(sched_mbox_trigger, 0, SCHED_STACK_SIZE);
+
+  for (i = 0; i < SCHED_WAKEUP_ROUNDS; i++) {
+    if (task_wait(&sched_wakeup_waiters, 100)) {
+      woken++;
+    }
+    if (sched_in_isr) {
+      misplaced++;
+    }
+  }
+
+  stop = 1;
+  ADCSRA = 0;
+  task_sleep(10);
+
+  t = task_create_prio(sched_sleep0_spin, 0, TASK_PRIO_COUNT);
+
+  snprintf(
+    detail,
+    sizeof(detail),
+    "%u of %u wakeups switched inside the handler, %u timed out, bad priority %s",
+    misplaced,
+    SCHED_WAKEUP_ROUNDS,
+    SCHED_WAKEUP_ROUNDS - woken,
+    t ? "accepted" : "rejected");
+  sched_result(!misplaced && woken == SCHED_WAKEUP_ROUNDS && !t, detail);
+}
+
+#if TASK_DEFER
+//
+// Work that an interrupt handler defers runs with interrupts enabled, after
+// the handler returns and before the interrupted task continues. Compares
+// the longest time with interrupts disabled against doing the work in the
+// handler.
+//
+
+// Work the handler has to get done, in cycles of 4.
+#define SCHED_DEFER_WORK 400
+
+// Number of interrupts per run.
+#define SCHED_DEFER_ROUNDS 200
+
+// Set to do the work in the handler instead of deferring it.
+static volatile uint8_t sched_defer_inline;
+
+// Work items done, work items deferred that ran inside the handler or with
+// interrupts disabled, and interrupts the interrupted task continued after
+// without the work done.
+static volatile uint16_t sched_defer_done;
+static volatile uint16_t sched_defer_misplaced;
+static volatile uint16_t sched_defer_late;
+
+static void sched_defer_work(void *data) {
+  if (!sched_defer_inline && (sched_in_isr || !(SREG & _BV(SREG_I)))) {
+    sched_defer_misplaced++;
+  }
+
+  _delay_loop_2(SCHED_DEFER_WORK);
+  sched_defer_done++;
+}
+
+static void sched_defer_isr(void) {
+  if (sched_defer_inline) {
+    sched_defer_work(0);
+  } else {
+    task_defer(sched_defer_work, 0);
+  }
+  sched_in_isr = 0;
+
+  task_yield_pending();
+}
+
+// Starts a conversion and busy waits past its end, over and over.
+static void sched_defer_trigger(void *data) {
+  uint16_t done;
+  uint16_t i;
+
+  for (i = 0; i < SCHED_DEFER_ROUNDS; i++) {
+    done = sched_defer_done;
+    ADCSRA |= _BV(ADSC);
+    _delay_loop_2(4 * SCHED_DEFER_WORK);
+    if (sched_defer_done == done) {
+      sched_defer_late++;
+    }
+  }
+
+  stop = 1;
+  task_suspend(0);
+}
+
+// Return the longest time with interrupts disabled during a run, in
+// microseconds.
+static double sched_defer_run(uint8_t in_isr) {
+  sched_begin("defer");
+  sched_defer_inline = in_isr;
+  task_create_ex(sched_defer_trigger, 0, SCHED_STACK_SIZE);
+
+  sim_irqoff_max = 0;
+  while (!stop) {
+    task_sleep(10);
+  }
+
+  return (double)sim_irqoff_max / (F_CPU / 1000000);
+}
+
+static void sched_defer(void) {
+  char detail[128];
+  double inline_us;
+  double deferred_us;
+
+  sched_adc_isr = sched_defer_isr;
+  ADCSRA = _BV(ADEN) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+  sched_defer_done = 0;
+  sched_defer_misplaced = 0;
+  sched_defer_late = 0;
+  inline_us = sched_defer_run(1);
+  deferred_us = sched_defer_run(0);
+  ADCSRA = 0;
+
+  snprintf(
+    detail,
+    sizeof(detail),
+    "interrupts off for at most %.1f us with the work in the handler, %.1f us deferred, %u misplaced, %u late",
+    inline_us,
+    deferred_us,
+    sched_defer_misplaced,
+    sched_defer_late);
+  sched_result(
+    sched_defer_done == 2 * SCHED_DEFER_ROUNDS &&
+    !sched_defer_misplaced &&
+    !sched_defer_late &&
+    deferred_us < inline_us,
+    detail);
+}
+#endif
+
+//
+// task_wake_all wakes up every task waiting on the queue, once.
+//
+
+#define SCHED_WAKE_ALL_TASKS 3
+
+static QUEUE sched_wake_all_waiters = { &sched_wake_all_waiters, &sched_wake_all_waiters };
+
+static void sched_wake_all_waiter(void *data) {
+  while (!stop) {
+    if (task_wait(&sched_wake_all_waiters, 0)) {
+      wakes++;
+    }
+  }
+
+  task_suspend(0);
+}
+
+static void sched_wake_all(void) {
+  char detail[64];
+  uint8_t i;
+  uint8_t n;
+
+  sched_begin("wake_all");
+  wakes = 0;
+  for (i = 0; i < SCHED_WAKE_ALL_TASKS; i++) {
+    task_create_ex(sched_wake_all_waiter, 0, SCHED_STACK_SIZE);
+  }
+
+  task_sleep(10);
+  n = task_wake_all(&sched_wake_all_waiters);
+  task_sleep(10);
+  stop = 1;
+  task_wake_all(&sched_wake_all_waiters);
+
+  snprintf(detail, sizeof(detail), "woke up %u of %u tasks, %u ran", n, SCHED_WAKE_ALL_TASKS, wakes);
+  sched_result(n == SCHED_WAKE_ALL_TASKS && wakes == SCHED_WAKE_ALL_TASKS, detail);
+  task_sleep(10);
+}
+
+//
+// The high-water mark of a task's stack, and the canary below it. Tasks run
+// on host stacks in the simulator, so the task writes to its stack itself.
+//
+
+// Bytes of stack the task uses.
+#define SCHED_STACK_USE 10
+
+static volatile task_t *sched_overflowed;
+
+void task_stack_overflow(task_t *t) {
+  sched_overflowed = t;
+  t->stack[0] = TASK_STACK_CANARY;
+}
+
+static void sched_stack_user(void *data) {
+  task_t *t = task_current();
+
+  memset(t->stack + t->stack_size - SCHED_STACK_USE, 0, SCHED_STACK_USE);
+  task_sleep(10);
+
+  // Overflow, and keep running until the tick catches it.
+  t->stack[0] = 0;
+  while (!stop) {
+    _delay_loop_2(1000);
+  }
+
+  task_suspend(0);
+}
+
+static void sched_stack(void) {
+  char detail[96];
+  task_t *t;
+  uint16_t used;
+  uint16_t free;
+
+  sched_begin("stack");
+  sched_overflowed = 0;
+  t = task_create_ex(sched_stack_user, 0, SCHED_STACK_SIZE);
+
+  task_sleep(4);
+  used = task_stack_used(t);
+  free = task_stack_free(t);
+  while (sched_overflowed == 0) {
+    task_sleep(2);
+  }
+  stop = 1;
+
+  snprintf(detail, sizeof(detail), "%u bytes used, %u free, overflow caught", used, free);
+  sched_result(
+    used == SCHED_STACK_USE + 1 &&
+    used + free == SCHED_STACK_SIZE &&
+    sched_overflowed == t,
+    detail);
+  task_sleep(10);
+}
+
+//
+// A task of high priority waiting for a mutex lends its priority to the low
+// priority owner, so that a busy task in between can't hold the owner off.
+// The driver task is the one in between.
+//
+
+// Time the owner and the driver keep busy for, in milliseconds.
+#define SCHED_MUTEX_OWNER_MS 20
+#define SCHED_MUTEX_DRIVER_MS 100
+
+static TASK_MUTEX_DEFINE(sched_lock);
+
+// Highest priority of the owner while holding the mutex, its priority after
+// unlocking it, and whether the waiter got the mutex.
+static volatile uint8_t sched_mutex_held_prio;
+static volatile uint8_t sched_mutex_after_prio;
+static volatile uint8_t sched_mutex_done;
+
+static void sched_mutex_owner(void *data) {
+  uint8_t i;
+
+  task_mutex_lock(&sched_lock);
+  for (i = 0; i < SCHED_MUTEX_OWNER_MS; i++) {
+    _delay_loop_2(F_CPU / 4000);
+    if (task_current()->prio > sched_mutex_held_prio) {
+      sched_mutex_held_prio = task_current()->prio;
+    }
+  }
+  task_mutex_unlock(&sched_lock);
+
+  sched_mutex_after_prio = task_current()->prio;
+  task_suspend(0);
+}
+
+static void sched_mutex_waiter(void *data) {
+  task_mutex_lock(&sched_lock);
+  sched_mutex_done = 1;
+  task_mutex_unlock(&sched_lock);
+
+  task_suspend(0);
+}
+
+static void sched_mutex(void) {
+  char detail[96];
+  uint8_t i;
+
+  sched_begin("mutex");
+  sched_mutex_held_prio = 0;
+  sched_mutex_after_prio = 0;
+  sched_mutex_done = 0;
+
+  // Let the owner lock the mutex.
+  task_create_ex(sched_mutex_owner, 0, SCHED_STACK_SIZE);
+  task_sleep(2);
+
+  // Keep busy while the waiter runs.
+  task_create_prio(sched_mutex_waiter, 0, TASK_PRIO_DEFAULT + 2);
+  for (i = 0; i < SCHED_MUTEX_DRIVER_MS && !sched_mutex_done; i++) {
+    _delay_loop_2(F_CPU / 4000);
+  }
+
+  // Let the owner finish.
+  task_sleep(10);
+
+  snprintf(
+    detail,
+    sizeof(detail),
+    "owner ran at priority %u holding the mutex, %u after, waiter %s",
+    sched_mutex_held_prio,
+    sched_mutex_after_prio,
+    sched_mutex_done ? "got it" : "held off");
+  sched_result(
+    sched_mutex_done &&
+    sched_mutex_held_prio == TASK_PRIO_DEFAULT + 2 &&
+    sched_mutex_after_prio == TASK_PRIO_DEFAULT,
+    detail);
+}
+
+#if TASK_PT && TASK_STATS
+//
+// The protothread host wakes up when a sleeping protothread is due, not
+// before, and polls a waiting one when task_pt_poll says so rather than on
+// every tick.
+//
+
+// Number of 20 ms sleeps of the sleeping protothread.
+#define SCHED_PT_SLEEPS 10
+
+// The protothread host (TASK_DEFINE in task.c).
+extern task_t _task__pt;
+
+struct sched_pt {
+  pt_t pt;
+  uint8_t n;
+  uint8_t off; // Wakeups not 20 ms after the previous one.
+  uint32_t last; // Tick of the last wakeup.
+};
+
+static struct sched_pt sched_pt_sleeper;
+static struct sched_pt sched_pt_waiter;
+static volatile uint8_t sched_pt_go;
+
+static uint8_t sched_pt_sleep(pt_t *pt) {
+  struct sched_pt *p = (struct sched_pt *)pt;
+
+  PT_BEGIN(pt);
+  p->last = task_now();
+  for (p->n = 0; p->n < SCHED_PT_SLEEPS; p->n++) {
+    PT_SLEEP(pt, 20);
+    if (task_now() - p->last != TASK_MSEC_TO_TICKS(20)) {
+      p->off++;
+    }
+    p->last = task_now();
+  }
+  PT_END(pt);
+}
+
+// Counts polls in n.
+static uint8_t sched_pt_wait(pt_t *pt) {
+  struct sched_pt *p = (struct sched_pt *)pt;
+
+  p->n++;
+  PT_BEGIN(pt);
+  PT_WAIT_UNTIL(pt, sched_pt_go);
+  p->last = task_now();
+  PT_END(pt);
+}
+
+static void sched_pt(void) {
+  char detail[128];
+  task_stats_t before;
+  task_stats_t after;
+  uint16_t sleeping;
+  uint16_t waiting;
+  uint32_t go;
+
+  sched_begin("pt");
+
+  task_stats(&_task__pt, &before);
+  task_pt_start(&sched_pt_sleeper.pt, sched_pt_sleep);
+  task_sleep(20 * SCHED_PT_SLEEPS + 20);
+  task_stats(&_task__pt, &after);
+  sleeping = after.scheduled - before.scheduled;
+
+  sched_pt_go = 0;
+  before = after;
+  task_pt_start(&sched_pt_waiter.pt, sched_pt_wait);
+  task_sleep(200);
+  sched_pt_go = 1;
+  go = task_now();
+  task_pt_poll();
+  task_sleep(10);
+  task_stats(&_task__pt, &after);
+  waiting = after.scheduled - before.scheduled;
+
+  snprintf(
+    detail,
+    sizeof(detail),
+    "host ran %u times for %u sleeps, %u off, and %u times waiting 200 ms, %+ld ticks late",
+    sleeping,
+    SCHED_PT_SLEEPS,
+    sched_pt_sleeper.off,
+    waiting,
+    (long)(sched_pt_waiter.last - go));
+  sched_result(
+    sched_pt_sleeper.n == SCHED_PT_SLEEPS &&
+    sched_pt_sleeper.off == 0 &&
+    sleeping <= SCHED_PT_SLEEPS + 1 &&
+    waiting <= 200 / TASK_PT_POLL_MS + 2 &&
+    sched_pt_waiter.last == go,
+    detail);
+}
+#endif
+
+static void sched_run(void *data) {
+  sched_sleep0();
+#if TASK_TICKLESS
+  sched_tickless();
+#endif
+#if TASK_STATS
+  sched_stats();
+#endif
+  sched_usleep();
+  sched_usleep_many();
+  sched_drift();
+#if TASK_SLEEP_ADC
+  sched_adc_sleep();
+#endif
+  sched_period();
+  sched_mbox();
+  sched_wakeup();
+  sched_wake_all();
+  sched_stack();
+  sched_mutex();
+#if TASK_PT && TASK_STATS
+  sched_pt();
+#endif
+#if TASK_DEFER
+  sched_defer();
+#endif
+  sched_tick();
+
+  printf("sched: %u checks failed\n", failures);
+  exit(failures ? 1 : 0);
+}
+
+// Runs above the tasks it creates (TASK_PRIO_DEFAULT).
+TASK_DEFINE(sched_driver, sched_run, 0, TASK_STACK_SIZE, TASK_PRIO_DEFAULT + 1);
+
+int main() {
+  // Runs until the checks finish.
+  sim_end = UINT64_MAX;
+  task_init();
+  task_start();
+  return 0;
+}
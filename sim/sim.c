@@ -0,0 +1,1006 @@
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ucontext.h>
+
+#include "sim.h"
+
+#define SIM_F_CPU 16000000ULL
+
+// Cycles charged for every register access, standing in for the
+// instructions around it.
+#define SIM_ACCESS_CYCLES 2
+
+// Host stack size of every context.
+#define SIM_STACK_SIZE (64 * 1024)
+
+// Register addresses (see avr/io.h).
+#define SIM_PINB 0x23
+#define SIM_PORTB 0x25
+#define SIM_PORTC 0x28
+#define SIM_PORTD 0x2B
+#define SIM_TIFR0 0x35
+#define SIM_GTCCR 0x43
+#define SIM_TCCR0A 0x44
+#define SIM_TCCR0B 0x45
+#define SIM_TCNT0 0x46
+#define SIM_OCR0A 0x47
+#define SIM_OCR0B 0x48
+#define SIM_PLLCSR 0x49
+#define SIM_PLLFRQ 0x52
+#define SIM_SMCR 0x53
+#define SIM_SREG 0x5F
+#define SIM_TIMSK0 0x6E
+#define SIM_ADCL 0x78
+#define SIM_ADCH 0x79
+#define SIM_ADCSRA 0x7A
+#define SIM_ADCSRB 0x7B
+#define SIM_ADMUX 0x7C
+#define SIM_TCCR1B 0x81
+#define SIM_TCNT1 0x84
+#define SIM_TCNT4 0xBE
+#define SIM_TC4H 0xBF
+#define SIM_TCCR4B 0xC1
+#define SIM_OCR4C 0xD1
+#define SIM_UCSR1A 0xC8
+#define SIM_UCSR1B 0xC9
+#define SIM_UBRR1 0xCC
+#define SIM_UDR1 0xCE
+
+// Unused bit of flag registers, see avr/io.h.
+#define SIM_FLAG_MARKER 0x80
+
+uint8_t sim_io[0x100] __attribute__((aligned(2)));
+uint8_t sim_ram[SIM_RAM_SIZE];
+uint64_t sim_cycles = 0;
+uint32_t sim_dds_hz = 0;
+uint64_t sim_dds_cycles = 0;
+uint32_t sim_dds_updates = 0;
+uint32_t sim_adc_conversions = 0;
+uint8_t sim_adc_quiet = 0;
+uint8_t sim_pin_low[5];
+uint64_t sim_end;
+uint64_t sim_wake_ns = 0;
+uint32_t sim_wakes = 0;
+uint64_t sim_irqoff_max = 0;
+
+// Set while interrupts are disabled, and the time they were disabled at.
+static uint8_t sim__irqoff = 0;
+static uint64_t sim__irqoff_start;
+
+// Register values as of the last update; a difference is a write.
+static uint8_t sim__shadow[0x100];
+
+// Virtual time spent in sim_sleep.
+static uint64_t sim__idle = 0;
+
+// Set while the I/O clock (timers, UART) is stopped by sleep.
+static uint8_t sim__clk_io_stopped = 0;
+
+// Host time at which the simulation started.
+static struct timespec sim__start;
+
+// Print every screen drawn on the LCD if set.
+static int sim__lcd_trace = 0;
+
+// Bytes sent by USART1 go here if set.
+static FILE *sim__capture = 0;
+
+// EEPROM contents are loaded from and saved to this file if set.
+static const char *sim__eeprom_path = 0;
+
+static void sim__fatal(const char *msg) {
+  fprintf(stderr, "sim: %s\n", msg);
+  abort();
+}
+
+//
+// Contexts
+//
+
+struct sim_context_s {
+  ucontext_t uc;
+  void (*fn)(void *);
+  void *data;
+};
+
+// Entry point of a new context.
+// makecontext only passes int arguments, so the pointer is split in two.
+static void sim__context_start(unsigned int hi, unsigned int lo) {
+  sim_context_t *c = (sim_context_t *)(((uintptr_t)hi << 32) | lo);
+
+  // Tasks start with interrupts enabled, like on the device.
+  sim_io[SIM_SREG] |= 0x80;
+  c->fn(c->data);
+  sim__fatal("task function returned");
+}
+
+sim_context_t *sim_context_create(void (*fn)(void *), void *data) {
+  sim_context_t *c = calloc(1, sizeof(*c));
+  uintptr_t p = (uintptr_t)c;
+
+  if (c == 0) {
+    sim__fatal("out of memory");
+  }
+
+  if (fn == 0) {
+    return c;
+  }
+
+  c->fn = fn;
+  c->data = data;
+  getcontext(&c->uc);
+  c->uc.uc_stack.ss_sp = malloc(SIM_STACK_SIZE);
+  c->uc.uc_stack.ss_size = SIM_STACK_SIZE;
+  c->uc.uc_link = 0;
+  if (c->uc.uc_stack.ss_sp == 0) {
+    sim__fatal("out of memory");
+  }
+
+  makecontext(
+    &c->uc,
+    (void (*)(void))sim__context_start,
+    2,
+    (unsigned int)(p >> 32),
+    (unsigned int)p);
+
+  return c;
+}
+
+void sim_context_switch(sim_context_t *from, sim_context_t *to) {
+  swapcontext(&from->uc, &to->uc);
+}
+
+//
+// LCD (HD44780U on PORTB, see hd44780u.h)
+//
+
+static struct {
+  uint8_t four_bit; // Set once the controller is in 4-bit mode.
+  uint8_t high; // Set if the high nibble of a byte has been latched.
+  uint8_t nibble; // High nibble.
+  uint8_t addr; // DDRAM address.
+  char ddram[2][40];
+} sim__lcd;
+
+static void sim__lcd_print(void) {
+  double t = (double)sim_cycles / SIM_F_CPU;
+
+  printf("%10.6f lcd |%.16s|%.16s|\n", t, sim__lcd.ddram[0], sim__lcd.ddram[1]);
+}
+
+const char *sim_lcd_row(uint8_t row) {
+  return sim__lcd.ddram[row & 1];
+}
+
+static void sim__lcd_clear(void) {
+  memset(sim__lcd.ddram, ' ', sizeof(sim__lcd.ddram));
+  sim__lcd.addr = 0;
+}
+
+static void sim__lcd_byte(uint8_t rs, uint8_t b) {
+  if (rs) {
+    sim__lcd.ddram[sim__lcd.addr >= 0x40][sim__lcd.addr & 0x3f] = b;
+    if (++sim__lcd.addr == 40) {
+      sim__lcd.addr = 0x40;
+    } else if (sim__lcd.addr == 0x40 + 40) {
+      sim__lcd.addr = 0;
+    }
+    return;
+  }
+
+  if (b & 0x80) {
+    // Set DDRAM address.
+    sim__lcd.addr = b & 0x7f;
+    if ((sim__lcd.addr & 0x3f) >= 40) {
+      sim__lcd.addr &= 0x40;
+    }
+  } else if (b & 0x40) {
+    // Set CGRAM address; not simulated.
+  } else if (b & 0x20) {
+    // Function set.
+    sim__lcd.four_bit = !(b & 0x10);
+  } else if (b == 0x01) {
+    // Clear display. Print the screen that is about to be cleared.
+    if (sim__lcd_trace) {
+      sim__lcd_print();
+    }
+    sim__lcd_clear();
+  } else if ((b & 0xfe) == 0x02) {
+    // Return home.
+    sim__lcd.addr = 0;
+  }
+}
+
+// Latch data on the falling edge of the enable pin.
+static void sim__lcd_edge(uint8_t port) {
+  uint8_t rs = (port >> PB4) & 1;
+  uint8_t nibble =
+    (((port >> PB6) & 1) << 3) |
+    (((port >> PB2) & 1) << 2) |
+    (((port >> PB3) & 1) << 1) |
+    (((port >> PB1) & 1) << 0);
+
+  if (!sim__lcd.four_bit) {
+    // The low data lines aren't connected and read as zero.
+    sim__lcd.high = 0;
+    sim__lcd_byte(rs, nibble << 4);
+    return;
+  }
+
+  if (!sim__lcd.high) {
+    sim__lcd.nibble = nibble;
+    sim__lcd.high = 1;
+    return;
+  }
+
+  sim__lcd.high = 0;
+  sim__lcd_byte(rs, (sim__lcd.nibble << 4) | nibble);
+}
+
+//
+// DDS (AD9850, see ad9850.h)
+//
+
+static uint64_t sim__dds_word = 0;
+
+// Port C: W_CLK (PC6) shifts in D7 (PD0), LSB first.
+static void sim__dds_portc(uint8_t prev, uint8_t cur) {
+  if (!(prev & _BV(PC6)) && (cur & _BV(PC6))) {
+    sim__dds_word >>= 1;
+    sim__dds_word |= (uint64_t)(sim_io[SIM_PORTD] & _BV(PD0)) << 39;
+  }
+}
+
+// Port D: FQ_UD (PD4) applies the 40-bit word, RESET (PD1) clears it.
+static void sim__dds_portd(uint8_t prev, uint8_t cur) {
+  uint8_t rise = ~prev & cur;
+
+  if (rise & _BV(PD1)) {
+    sim__dds_word = 0;
+    sim_dds_hz = 0;
+    sim_dds_cycles = sim_cycles;
+  }
+
+  if (rise & _BV(PD4)) {
+    uint32_t f = (uint32_t)sim__dds_word;
+    sim_dds_hz = ((uint64_t)f * 125000000 + (1ULL << 31)) >> 32;
+    sim_dds_cycles = sim_cycles;
+    sim_dds_updates++;
+  }
+}
+
+//
+// Timer/Counter0
+//
+
+static uint8_t sim__t0_count = 0;
+static uint8_t sim__t0_flags = 0;
+static uint64_t sim__t0_last = 0; // Time the counter was advanced to.
+static uint8_t sim__t0_blocked = 0; // Set by a write of TCNT0.
+
+// The timers share a free-running prescaler, which was reset at this time.
+// A prescaler of N clocks the timer whenever it reaches a multiple of N,
+// however long ago the timer selected it.
+static uint64_t sim__psr_ref = 0;
+
+static const uint16_t sim__prescale[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+
+// Advance the counter to the specified time.
+static void sim__t0_advance(uint64_t cycles) {
+  uint16_t ps = sim__prescale[sim_io[SIM_TCCR0B] & 7];
+  uint8_t top;
+  uint64_t n;
+
+  if (sim__clk_io_stopped) {
+    return;
+  }
+
+  n = 0;
+  if (ps) {
+    n = (cycles - sim__psr_ref) / ps - (sim__t0_last - sim__psr_ref) / ps;
+  }
+  sim__t0_last = cycles;
+
+  // CTC mode counts up to OCR0A; normal mode up to 0xff.
+  top = (sim_io[SIM_TCCR0A] & _BV(WGM01)) ? sim_io[SIM_OCR0A] : 0xff;
+
+  for (; n > 0; n--) {
+    // A compare match sets its flag at the next timer clock, as the counter
+    // moves on. A write of TCNT0 blocks the match for that clock.
+    if (!sim__t0_blocked) {
+      if (sim__t0_count == sim_io[SIM_OCR0A]) {
+        sim__t0_flags |= _BV(OCF0A);
+      }
+      if (sim__t0_count == sim_io[SIM_OCR0B]) {
+        sim__t0_flags |= _BV(OCF0B);
+      }
+    }
+    sim__t0_blocked = 0;
+
+    if (sim__t0_count == top) {
+      sim__t0_count = 0;
+      if (top == 0xff) {
+        sim__t0_flags |= _BV(TOV0);
+      }
+    } else {
+      sim__t0_count++;
+    }
+  }
+}
+
+// Cycles until the counter next changes.
+static uint64_t sim__t0_next(void) {
+  uint16_t ps = sim__prescale[sim_io[SIM_TCCR0B] & 7];
+
+  if (ps == 0) {
+    return UINT64_MAX;
+  }
+
+  return ps - (sim_cycles - sim__psr_ref) % ps;
+}
+
+//
+// Timer/Counter1 (free running)
+//
+
+static uint16_t sim__t1_count = 0;
+static uint64_t sim__t1_last = 0; // Time the counter was advanced to.
+
+// Advance the counter to the specified time.
+static void sim__t1_advance(uint64_t cycles) {
+  uint16_t ps = sim__prescale[sim_io[SIM_TCCR1B] & 7];
+
+  if (sim__clk_io_stopped) {
+    return;
+  }
+
+  if (ps) {
+    sim__t1_count += (cycles - sim__psr_ref) / ps - (sim__t1_last - sim__psr_ref) / ps;
+  }
+  sim__t1_last = cycles;
+}
+
+//
+// Timer/Counter4 (free running, clocked from the PLL)
+//
+// Only the PLL clock source is modeled: 48 MHz (PDIV 0100) divided by the
+// postscaler for the timer (PLLTM), then by the prescaler. It keeps running
+// while the I/O clock is stopped. Counts are taken relative to time 0, in
+// steps of 1/6 cycle (96 MHz). The counter wraps after reaching the top in
+// OCR4C, whose high byte is written through TC4H first.
+//
+
+static uint16_t sim__t4_count = 0;
+static uint16_t sim__t4_top = 0xff;
+static uint64_t sim__t4_last = 0; // Time the counter was advanced to.
+
+// Advance the counter to the specified time, with the clock configured in
+// the specified registers.
+static void sim__t4_advance(uint64_t cycles, const uint8_t *io) {
+  uint8_t cs = io[SIM_TCCR4B] & 0x0f;
+  uint8_t tm = (io[SIM_PLLFRQ] >> PLLTM0) & 3;
+  uint64_t div;
+
+  if (cs && tm && (io[SIM_PLLCSR] & _BV(PLOCK))) {
+    if ((io[SIM_PLLFRQ] & 0x0f) != _BV(PDIV2)) {
+      sim__fatal("unsupported PLL frequency");
+    }
+
+    // Postscaler of 1, 1.5, or 2, and prescaler of 2^(cs - 1), in 96 MHz
+    // clocks.
+    div = (tm + 1) << (cs - 1);
+    sim__t4_count = (sim__t4_count + (cycles * (96000000 / SIM_F_CPU)) / div - (sim__t4_last * (96000000 / SIM_F_CPU)) / div) % (sim__t4_top + 1);
+  }
+  sim__t4_last = cycles;
+}
+
+// Reset the prescaler at the specified time.
+static void sim__psr_reset(uint64_t cycles) {
+  sim__t0_advance(cycles);
+  sim__t1_advance(cycles);
+  sim__psr_ref = sim__t0_last = sim__t1_last = cycles;
+}
+
+//
+// ADC
+//
+
+static uint8_t sim__adc_busy = 0;
+static uint8_t sim__adc_first = 1;
+static uint8_t sim__adc_mux; // Input of the running conversion.
+static uint64_t sim__adc_done;
+
+// Time the ADC was enabled, which started its prescaler.
+static uint64_t sim__adc_ref = 0;
+
+static const uint8_t sim__adc_div[8] = { 2, 2, 4, 8, 16, 32, 64, 128 };
+
+// Start a conversion requested at the specified time.
+// It starts at the next rising edge of the ADC clock. The input is selected
+// when a conversion starts.
+static void sim__adc_start(uint64_t at) {
+  uint8_t first = sim__adc_first;
+  uint8_t div = sim__adc_div[sim_io[SIM_ADCSRA] & 7];
+
+  at += (div - (at - sim__adc_ref) % div) % div;
+
+  // The first conversion after enabling the ADC takes 25 ADC clocks.
+  sim__adc_busy = 1;
+  sim_adc_quiet = 0;
+  sim__adc_first = 0;
+  sim__adc_mux = sim_io[SIM_ADMUX];
+  sim__adc_done = at + (first ? 25 : 13) * div;
+}
+
+// Take a write to ADCSRA, made at the specified time.
+static void sim__adc_write(uint8_t prev, uint8_t cur, uint64_t at) {
+  // Writing a one clears the interrupt flag.
+  if (cur & _BV(ADIF)) {
+    cur &= ~_BV(ADIF);
+  } else if (prev & _BV(ADIF)) {
+    cur |= _BV(ADIF);
+  }
+
+  if ((cur & _BV(ADEN)) && !(prev & _BV(ADEN))) {
+    sim__adc_ref = at;
+  }
+
+  if (!(cur & _BV(ADEN))) {
+    sim__adc_busy = 0;
+    sim__adc_first = 1;
+    cur &= ~_BV(ADSC);
+    sim_io[SIM_ADCSRA] = cur;
+  } else if (sim__adc_busy) {
+    // Writing a zero doesn't stop a conversion.
+    sim_io[SIM_ADCSRA] = cur | _BV(ADSC);
+  } else {
+    sim_io[SIM_ADCSRA] = cur;
+    if (cur & _BV(ADSC)) {
+      sim__adc_start(at);
+    }
+  }
+}
+
+static void sim__adc_advance(void) {
+  uint16_t v;
+
+  if (!sim__adc_busy || sim_cycles < sim__adc_done) {
+    return;
+  }
+
+  v = sim_adc_sample(sim__adc_mux & 0x1f) & 0x3ff;
+  if (sim__adc_mux & _BV(ADLAR)) {
+    v <<= 6;
+  }
+
+  sim_io[SIM_ADCL] = v & 0xff;
+  sim_io[SIM_ADCH] = v >> 8;
+  sim_io[SIM_ADCSRA] |= _BV(ADIF);
+  sim__adc_busy = 0;
+  sim_adc_conversions++;
+
+  // In free running mode the next conversion starts right away.
+  if ((sim_io[SIM_ADCSRA] & _BV(ADATE)) && (sim_io[SIM_ADCSRB] & 0x0f) == 0) {
+    sim__adc_start(sim__adc_done);
+  } else {
+    sim_io[SIM_ADCSRA] &= ~_BV(ADSC);
+  }
+}
+
+static uint64_t sim__adc_next(void) {
+  if (!sim__adc_busy) {
+    return UINT64_MAX;
+  }
+
+  return (sim__adc_done > sim_cycles) ? sim__adc_done - sim_cycles : 1;
+}
+
+//
+// USART1 (transmitter only)
+//
+// The data register is write only, so every access to it is a write. It is
+// taken at the next update, like writes to other registers, but by access
+// rather than by value because consecutive bytes may be equal.
+//
+
+static uint8_t sim__uart_written = 0;
+static uint8_t sim__uart_held = 0; // Byte waiting for the shift register.
+static uint64_t sim__uart_done = 0; // Time the shift register is empty.
+
+// Cycles per frame of 10 bits.
+static uint64_t sim__uart_frame(void) {
+  uint16_t ubrr = sim_io[SIM_UBRR1] | ((sim_io[SIM_UBRR1 + 1] & 0x0f) << 8);
+  uint8_t div = (sim_io[SIM_UCSR1A] & _BV(U2X1)) ? 8 : 16;
+
+  return 10ULL * div * (ubrr + 1);
+}
+
+static void sim__uart_advance(void) {
+  if (sim__clk_io_stopped) {
+    return;
+  }
+
+  if (sim__uart_written) {
+    sim__uart_written = 0;
+    if (sim_io[SIM_UCSR1B] & _BV(TXEN1)) {
+      if (sim__capture) {
+        fputc(sim_io[SIM_UDR1], sim__capture);
+      }
+      if (sim_cycles >= sim__uart_done) {
+        sim__uart_done = sim_cycles + sim__uart_frame();
+      } else {
+        sim__uart_held = 1;
+      }
+    }
+  }
+
+  if (sim__uart_held && sim_cycles >= sim__uart_done) {
+    sim__uart_held = 0;
+    sim__uart_done += sim__uart_frame();
+  }
+
+  if (sim__uart_held) {
+    sim_io[SIM_UCSR1A] &= ~_BV(UDRE1);
+  } else {
+    sim_io[SIM_UCSR1A] |= _BV(UDRE1);
+  }
+}
+
+static uint64_t sim__uart_next(void) {
+  if (!sim__uart_held) {
+    return UINT64_MAX;
+  }
+
+  return (sim__uart_done > sim_cycles) ? sim__uart_done - sim_cycles : 1;
+}
+
+//
+// Interrupts
+//
+
+void __vector_21(void) __attribute__((weak));
+void __vector_22(void) __attribute__((weak));
+void __vector_26(void) __attribute__((weak));
+void __vector_29(void) __attribute__((weak));
+
+void __vector_21(void) {
+  sim__fatal("unhandled TIMER0_COMPA interrupt");
+}
+
+void __vector_22(void) {
+  sim__fatal("unhandled TIMER0_COMPB interrupt");
+}
+
+void __vector_26(void) {
+  sim__fatal("unhandled USART1_UDRE interrupt");
+}
+
+void __vector_29(void) {
+  sim__fatal("unhandled ADC interrupt");
+}
+
+// Return handler of the pending interrupt with the highest priority.
+// Clears its flag, like the processor does when it calls the handler.
+static void (*sim__pending(uint8_t clear))(void) {
+  uint8_t t0 = sim__t0_flags & sim_io[SIM_TIMSK0];
+
+  // A handler that just wrote the data register may have filled it.
+  sim__uart_advance();
+
+  if (t0 & _BV(OCF0A)) {
+    if (clear) {
+      sim__t0_flags &= ~_BV(OCF0A);
+    }
+    return __vector_21;
+  }
+
+  if (t0 & _BV(OCF0B)) {
+    if (clear) {
+      sim__t0_flags &= ~_BV(OCF0B);
+    }
+    return __vector_22;
+  }
+
+  // The flag stays set until the handler writes a byte or disables it.
+  if ((sim_io[SIM_UCSR1B] & _BV(UDRIE1)) && (sim_io[SIM_UCSR1A] & _BV(UDRE1))) {
+    return __vector_26;
+  }
+
+  if ((sim_io[SIM_ADCSRA] & (_BV(ADIF) | _BV(ADIE))) == (_BV(ADIF) | _BV(ADIE))) {
+    if (clear) {
+      sim_io[SIM_ADCSRA] &= ~_BV(ADIF);
+    }
+    return __vector_29;
+  }
+
+  return 0;
+}
+
+//
+// Virtual clock
+//
+
+void sim_poll(void) __attribute__((weak));
+void sim_poll(void) {
+}
+
+static void sim__finish(void) {
+  struct timespec now;
+  double real;
+  double virt = (double)sim_cycles / SIM_F_CPU;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  real = (now.tv_sec - sim__start.tv_sec) + (now.tv_nsec - sim__start.tv_nsec) / 1e9;
+
+  if (sim__lcd_trace) {
+    sim__lcd_print();
+  }
+
+  printf(
+    "sim: %.3f s simulated in %.3f s, %.1f%% idle, dds at %lu Hz\n",
+    virt,
+    real,
+    100.0 * sim__idle / sim_cycles,
+    (unsigned long)sim_dds_hz);
+  exit(0);
+}
+
+// Apply writes since the last update, advance the peripherals by the
+// specified number of cycles, and publish their registers.
+static void sim__update(uint64_t cycles) {
+  uint8_t v;
+
+  // SREG may have been written since the last update.
+  if (!(sim_io[SIM_SREG] & 0x80)) {
+    if (!sim__irqoff) {
+      sim__irqoff = 1;
+      sim__irqoff_start = sim_cycles;
+    }
+  } else {
+    sim__irqoff = 0;
+  }
+
+  sim_cycles += cycles;
+  if (sim__irqoff && sim_cycles - sim__irqoff_start > sim_irqoff_max) {
+    sim_irqoff_max = sim_cycles - sim__irqoff_start;
+  }
+  if (sim_cycles >= sim_end) {
+    sim__finish();
+  }
+
+  if ((v = sim_io[SIM_PORTB]) != sim__shadow[SIM_PORTB]) {
+    if ((sim__shadow[SIM_PORTB] & _BV(PB5)) && !(v & _BV(PB5))) {
+      sim__lcd_edge(v);
+    }
+  }
+  if ((v = sim_io[SIM_PORTC]) != sim__shadow[SIM_PORTC]) {
+    sim__dds_portc(sim__shadow[SIM_PORTC], v);
+  }
+  if ((v = sim_io[SIM_PORTD]) != sim__shadow[SIM_PORTD]) {
+    sim__dds_portd(sim__shadow[SIM_PORTD], v);
+  }
+  if ((v = sim_io[SIM_TCNT0]) != sim__shadow[SIM_TCNT0]) {
+    sim__t0_advance(sim_cycles - cycles);
+    sim__t0_count = v;
+    sim__t0_blocked = 1;
+  }
+  if (memcmp(&sim_io[SIM_TCNT1], &sim__shadow[SIM_TCNT1], 2) != 0) {
+    sim__t1_advance(sim_cycles - cycles);
+    sim__t1_count = sim_io[SIM_TCNT1] | (sim_io[SIM_TCNT1 + 1] << 8);
+  }
+  if ((v = sim_io[SIM_PLLCSR]) != sim__shadow[SIM_PLLCSR] ||
+      sim_io[SIM_PLLFRQ] != sim__shadow[SIM_PLLFRQ] ||
+      sim_io[SIM_TCCR4B] != sim__shadow[SIM_TCCR4B]) {
+    // The PLL locks right away.
+    sim__t4_advance(sim_cycles - cycles, sim__shadow);
+    sim_io[SIM_PLLCSR] = (v & _BV(PLLE)) ? (v | _BV(PLOCK)) : (v & ~_BV(PLOCK));
+  }
+  if (sim_io[SIM_OCR4C] != sim__shadow[SIM_OCR4C]) {
+    sim__t4_advance(sim_cycles - cycles, sim_io);
+    sim__t4_top = sim_io[SIM_OCR4C] | ((sim_io[SIM_TC4H] & 3) << 8);
+  }
+  if ((v = sim_io[SIM_GTCCR]) & _BV(PSRSYNC)) {
+    // With TSM set, the prescaler stays in reset until TSM is cleared.
+    if (v & _BV(TSM)) {
+      sim__psr_reset(sim_cycles);
+    } else {
+      sim__psr_reset(sim_cycles - cycles);
+      sim_io[SIM_GTCCR] &= ~_BV(PSRSYNC);
+    }
+  }
+  if (!((v = sim_io[SIM_TIFR0]) & SIM_FLAG_MARKER)) {
+    sim__t0_flags &= ~v;
+  }
+  if ((v = sim_io[SIM_ADCSRA]) != sim__shadow[SIM_ADCSRA]) {
+    sim__adc_write(sim__shadow[SIM_ADCSRA], v, sim_cycles - cycles);
+  }
+
+  sim__t0_advance(sim_cycles);
+  sim__t1_advance(sim_cycles);
+  sim__t4_advance(sim_cycles, sim_io);
+  sim__adc_advance();
+  sim__uart_advance();
+
+  // Input pins read as high (pulled up) unless pulled low.
+  for (v = 0; v < 5; v++) {
+    uint8_t ddr = sim_io[SIM_PINB + 3 * v + 1];
+    uint8_t port = sim_io[SIM_PINB + 3 * v + 2];
+    sim_io[SIM_PINB + 3 * v] = (port & ddr) | (~ddr & ~sim_pin_low[v]);
+  }
+
+  sim_io[SIM_TCNT0] = sim__t0_count;
+  sim_io[SIM_TCNT1] = sim__t1_count & 0xff;
+  sim_io[SIM_TCNT1 + 1] = sim__t1_count >> 8;
+  sim_io[SIM_TCNT4] = sim__t4_count & 0xff;
+  sim_io[SIM_TIFR0] = sim__t0_flags | SIM_FLAG_MARKER;
+  memcpy(sim__shadow, sim_io, sizeof(sim__shadow));
+
+  sim_poll();
+}
+
+// Call pending interrupt handlers while interrupts are enabled.
+// A handler may switch to another task; it returns when the task resumes.
+static void sim__deliver(void) {
+  void (*fn)(void);
+
+  while ((sim_io[SIM_SREG] & 0x80) && (fn = sim__pending(1)) != 0) {
+    sim__shadow[SIM_TIFR0] = sim_io[SIM_TIFR0] = sim__t0_flags | SIM_FLAG_MARKER;
+    sim__shadow[SIM_ADCSRA] = sim_io[SIM_ADCSRA];
+    sim_io[SIM_SREG] &= ~0x80;
+    fn();
+    sim_io[SIM_SREG] |= 0x80;
+  }
+}
+
+volatile uint8_t *sim_reg(uint16_t addr) {
+  sim__update(SIM_ACCESS_CYCLES);
+  sim__deliver();
+  if (addr == SIM_UDR1) {
+    sim__uart_written = 1;
+  }
+  // Accessing the low byte latches the high byte of the 10-bit counter.
+  if (addr == SIM_TCNT4) {
+    sim_io[SIM_TC4H] = sim__shadow[SIM_TC4H] = (sim__t4_count >> 8) & 3;
+  }
+  return &sim_io[addr];
+}
+
+void sim_sei(void) {
+  sim__update(1);
+  sim_io[SIM_SREG] |= 0x80;
+  sim__deliver();
+}
+
+void sim_cli(void) {
+  sim__update(1);
+  sim_io[SIM_SREG] &= ~0x80;
+}
+
+void sim_delay_cycles(uint32_t cycles) {
+  sim__update(cycles);
+  sim__deliver();
+}
+
+void sim_sleep(void) {
+  uint64_t start;
+  uint64_t step;
+  uint8_t adc_nr;
+  struct timespec t0, t1;
+
+  sim__update(1);
+  sim_io[SIM_SREG] |= 0x80;
+  start = sim_cycles;
+
+  // ADC Noise Reduction mode starts a conversion and stops the I/O clock
+  // until the ADC wakes the processor up. Other modes sleep like Idle mode.
+  adc_nr = (sim_io[SIM_SMCR] & 0x0f) == (_BV(SM0) | _BV(SE));
+  if (adc_nr) {
+    if ((sim_io[SIM_ADCSRA] & _BV(ADEN)) && !sim__adc_busy) {
+      sim_io[SIM_ADCSRA] |= _BV(ADSC);
+      sim__shadow[SIM_ADCSRA] = sim_io[SIM_ADCSRA];
+      sim__adc_start(sim_cycles);
+      sim_adc_quiet = 1;
+    }
+    sim__clk_io_stopped = 1;
+  }
+
+  // Skip to the next timer count or ADC result until an interrupt is pending.
+  while (sim__pending(0) == 0) {
+    if (adc_nr) {
+      step = sim__adc_next();
+      if (step == UINT64_MAX) {
+        sim__fatal("sleeping in ADC noise reduction mode without a conversion");
+      }
+    } else {
+      step = sim__t0_next();
+      if (sim__adc_next() < step) {
+        step = sim__adc_next();
+      }
+      if (sim__uart_next() < step) {
+        step = sim__uart_next();
+      }
+      if (step == UINT64_MAX) {
+        step = 1024;
+      }
+    }
+    sim__update(step);
+  }
+
+  if (adc_nr) {
+    uint64_t stopped = sim_cycles - start;
+
+    // Woken up by something else; the rest of the conversion isn't quiet.
+    if (sim__adc_busy) {
+      sim_adc_quiet = 0;
+    }
+
+    sim__clk_io_stopped = 0;
+    sim__t0_last += stopped;
+    sim__psr_ref += stopped;
+    sim__t1_last += stopped;
+    if (sim__uart_done > start) {
+      sim__uart_done += stopped;
+    }
+  }
+
+  sim__idle += sim_cycles - start;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  sim__deliver();
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  sim_wake_ns += (t1.tv_sec - t0.tv_sec) * 1000000000ull + (t1.tv_nsec - t0.tv_nsec);
+  sim_wakes++;
+}
+
+//
+// EEPROM (see avr/eeprom.h)
+//
+// EEMEM variables live in the sim_eeprom section, between the symbols the
+// linker defines for it.
+//
+
+#define SIM_EEPROM_SIZE 1024
+
+// Erase and write of a byte take 3.4 ms.
+#define SIM_EEPROM_WRITE_CYCLES (34 * SIM_F_CPU / 10000)
+
+// Reads halt the processor for 4 cycles.
+#define SIM_EEPROM_READ_CYCLES 4
+
+extern uint8_t __start_sim_eeprom[] __attribute__((weak));
+extern uint8_t __stop_sim_eeprom[] __attribute__((weak));
+
+static size_t sim__eeprom_size(void) {
+  return __stop_sim_eeprom - __start_sim_eeprom;
+}
+
+static void sim__eeprom_check(const void *p, size_t n) {
+  const uint8_t *b = p;
+
+  if (b < __start_sim_eeprom || b + n > __stop_sim_eeprom) {
+    sim__fatal("EEPROM access outside EEMEM variables");
+  }
+}
+
+static void sim__eeprom_write(uint8_t *p, uint8_t value) {
+  uint32_t left = SIM_EEPROM_WRITE_CYCLES;
+
+  // Busy waits like the device, with interrupts handled in between.
+  while (left > 0) {
+    uint32_t step = (left < 1024) ? left : 1024;
+    sim_delay_cycles(step);
+    left -= step;
+  }
+
+  *p = value;
+}
+
+uint8_t eeprom_read_byte(const uint8_t *p) {
+  sim__eeprom_check(p, 1);
+  sim_delay_cycles(SIM_EEPROM_READ_CYCLES);
+  return *p;
+}
+
+uint16_t eeprom_read_word(const uint16_t *p) {
+  uint16_t v;
+
+  eeprom_read_block(&v, p, sizeof(v));
+  return v;
+}
+
+void eeprom_read_block(void *dst, const void *src, size_t n) {
+  sim__eeprom_check(src, n);
+  sim_delay_cycles(SIM_EEPROM_READ_CYCLES * n);
+  memcpy(dst, src, n);
+}
+
+void eeprom_update_byte(uint8_t *p, uint8_t value) {
+  eeprom_update_block(&value, p, 1);
+}
+
+void eeprom_update_word(uint16_t *p, uint16_t value) {
+  eeprom_update_block(&value, p, sizeof(value));
+}
+
+void eeprom_update_block(const void *src, void *dst, size_t n) {
+  const uint8_t *s = src;
+  uint8_t *d = dst;
+  size_t i;
+
+  sim__eeprom_check(dst, n);
+  for (i = 0; i < n; i++) {
+    sim_delay_cycles(SIM_EEPROM_READ_CYCLES);
+    if (d[i] != s[i]) {
+      sim__eeprom_write(&d[i], s[i]);
+    }
+  }
+}
+
+static void sim__eeprom_save(void) {
+  FILE *f = fopen(sim__eeprom_path, "wb");
+
+  if (f == 0 || fwrite(__start_sim_eeprom, 1, sim__eeprom_size(), f) != sim__eeprom_size()) {
+    perror(sim__eeprom_path);
+  }
+  if (f != 0) {
+    fclose(f);
+  }
+}
+
+static void sim__eeprom_init(void) {
+  FILE *f;
+
+  if (sim__eeprom_size() > SIM_EEPROM_SIZE) {
+    sim__fatal("EEMEM variables don't fit in the EEPROM");
+  }
+
+  // Erased EEPROM reads as all ones.
+  memset(__start_sim_eeprom, 0xff, sim__eeprom_size());
+
+  if (sim__eeprom_path == 0) {
+    return;
+  }
+
+  // Start erased if the file doesn't exist yet.
+  if ((f = fopen(sim__eeprom_path, "rb")) != 0) {
+    if (fread(__start_sim_eeprom, 1, sim__eeprom_size(), f) != sim__eeprom_size()) {
+      sim__fatal("EEPROM file doesn't match the EEMEM variables");
+    }
+    fclose(f);
+  }
+
+  atexit(sim__eeprom_save);
+}
+
+__attribute__((constructor))
+static void sim__init(void) {
+  const char *s;
+  double seconds = 10;
+
+  if ((s = getenv("SIM_SECONDS")) != 0) {
+    seconds = atof(s);
+  }
+  if ((s = getenv("SIM_LCD")) != 0) {
+    sim__lcd_trace = atoi(s);
+  }
+  if ((s = getenv("SIM_CAPTURE")) != 0) {
+    if ((sim__capture = fopen(s, "wb")) == 0) {
+      perror(s);
+      exit(1);
+    }
+  }
+
+  sim__eeprom_path = getenv("SIM_EEPROM");
+  sim__eeprom_init();
+
+  sim_end = seconds * SIM_F_CPU;
+  sim__lcd_clear();
+  sim_io[SIM_TIFR0] = sim__shadow[SIM_TIFR0] = SIM_FLAG_MARKER;
+  setvbuf(stdout, 0, _IOLBF, 0);
+  clock_gettime(CLOCK_MONOTONIC, &sim__start);
+}
@@ -0,0 +1,131 @@
+#ifndef _SIM_H
+#define _SIM_H
+
+#include <stdint.h>
+
+/*
+ * Host simulation of the ATmega32U4 and the analyzer board.
+ *
+ * The virtual clock counts CPU cycles. It only advances when the firmware
+ * accesses an I/O register (a few cycles each), busy waits, or sleeps, so it
+ * runs far faster than real time and doesn't depend on the host.
+ *
+ * The simulation ends after SIM_SECONDS of virtual time (environment
+ * variable, default 10). With SIM_LCD=1 every screen the firmware draws is
+ * printed.
+ *
+ * The ADC inputs are driven by a model of the resistive bridge and its
+ * detectors, with a load that is configured through the environment:
+ *
+ *   SIM_LOAD   Series RLC load "R,L,C" in ohm, henry and farad. A capacitance
+ *              of 0 leaves out the capacitor. Default "50,20e-6,370e-12",
+ *              which is resonant at 1.85 MHz.
+ *   SIM_LINE   Transmission line between bridge and load "Z0,length,vf,loss"
+ *              in ohm, meter, velocity factor and dB per meter. Default none.
+ *   SIM_BRIDGE Imperfections of the bridge "directivity,tracking" in dB at
+ *              30 MHz, both falling linearly toward DC: the leakage to the
+ *              reverse detector below the drive, and the extra loss of the
+ *              reverse path. Default none.
+ *   SIM_VSRC   Peak voltage at the bridge input (default 2.0).
+ *   SIM_DIODE  Forward voltage drop of the detector diodes (default 0).
+ *   SIM_SETTLE Time constant of the detector filters in microseconds
+ *              (default 300).
+ *   SIM_NOISE  RMS noise added to every conversion, in ADC counts
+ *              (default 0).
+ *   SIM_CPU_NOISE
+ *              RMS noise added to conversions that don't run in ADC Noise
+ *              Reduction sleep, in ADC counts (default 0). Stands in for
+ *              the digital noise of the running processor.
+ *   SIM_SEED   Seed of the noise generator (default 1).
+ *
+ * Firmware built with CAPTURE streams its raw measurements out of USART1
+ * (see capture.h). They are written to the file named by SIM_CAPTURE, if
+ * set. SIM_REPLAY names a capture to take the ADC counts from instead of
+ * the bridge model (see replay.c).
+ *
+ * EEPROM starts erased. With SIM_EEPROM set, it is loaded from that file if
+ * it exists and saved to it on exit.
+ */
+
+// Execution context of a task or of the scheduler.
+typedef struct sim_context_s sim_context_t;
+
+// Create context that runs fn(data) on a host stack of its own.
+// If fn is NULL, the context can only be switched away from.
+sim_context_t *sim_context_create(void (*fn)(void *), void *data);
+
+// Save the running context in from and resume to.
+void sim_context_switch(sim_context_t *from, sim_context_t *to);
+
+// Enable interrupts and wait until at least one is handled.
+// Stands in for "sei" followed by "sleep".
+void sim_sleep(void);
+
+// Simulated RAM that tasks created at run time are carved from.
+#define SIM_RAM_SIZE 0x800
+extern uint8_t sim_ram[SIM_RAM_SIZE];
+
+// Virtual clock, in CPU cycles.
+extern uint64_t sim_cycles;
+
+// Virtual time at which the simulation ends.
+extern uint64_t sim_end;
+
+// Host time spent in the interrupt handlers that woke the processor up, in
+// nanoseconds, and the number of wakeups. The virtual clock doesn't count
+// instructions, so this is the only measure of the cost of a handler.
+extern uint64_t sim_wake_ns;
+extern uint32_t sim_wakes;
+
+// Longest time interrupts were disabled, interrupt handlers included, in
+// cycles. Measured at register accesses, so to within a few cycles. A test
+// harness may reset it.
+extern uint64_t sim_irqoff_max;
+
+// Frequency the DDS was last set to, in Hz, and the time it was set at.
+extern uint32_t sim_dds_hz;
+extern uint64_t sim_dds_cycles;
+
+// Number of times the DDS frequency was set.
+extern uint32_t sim_dds_updates;
+
+// Number of completed ADC conversions.
+extern uint32_t sim_adc_conversions;
+
+// Set if the processor slept in ADC Noise Reduction mode throughout the
+// conversion that completes next.
+extern uint8_t sim_adc_quiet;
+
+// Input pins that are pulled low, one mask per port (B, C, D, E, F).
+// Buttons are active low.
+extern uint8_t sim_pin_low[5];
+
+// Called after every update of the simulated peripherals. Must not switch
+// contexts. The default does nothing; a test harness can override it.
+void sim_poll(void);
+
+// Characters in DDRAM of LCD row 0 or 1; the first 16 are visible.
+const char *sim_lcd_row(uint8_t row);
+
+// Calibration standard connected to the bridge in place of the load: 'o'
+// (open), 's' (short) or 'l' (load), or 0 for the configured load.
+extern char sim_standard;
+
+// Return the ADC count for the input selected by mux (see bridge.c).
+uint16_t sim_adc_sample(uint8_t mux);
+
+// Return the VSWR of the simulated load at the specified frequency, as seen
+// by an ideal 50 ohm bridge. When replaying, the VSWR of the mean captured
+// counts instead.
+double sim_load_vswr(uint32_t hz);
+
+// Set if a capture is replayed (SIM_REPLAY).
+extern int sim_replay;
+
+// Return the replayed ADC count for the input selected by mux.
+uint16_t sim_replay_sample(uint8_t mux);
+
+// Return the VSWR of the mean captured counts at the specified frequency.
+double sim_replay_vswr(uint32_t hz);
+
+#endif
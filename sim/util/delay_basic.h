@@ -0,0 +1,21 @@
+#ifndef _SIM_UTIL_DELAY_BASIC_H
+#define _SIM_UTIL_DELAY_BASIC_H
+
+#include <stdint.h>
+
+// Host stand-in for <util/delay_basic.h>.
+// Busy loops advance the virtual clock by the cycles they would take.
+
+void sim_delay_cycles(uint32_t cycles);
+
+// Three cycles per iteration; a count of 0 means 256 iterations.
+static inline void _delay_loop_1(uint8_t count) {
+  sim_delay_cycles(3 * (count ? count : 256));
+}
+
+// Four cycles per iteration; a count of 0 means 65536 iterations.
+static inline void _delay_loop_2(uint16_t count) {
+  sim_delay_cycles(4 * (count ? count : 65536UL));
+}
+
+#endif
@@ -1,15 +1,35 @@
 #include <avr/interrupt.h>
 #include <avr/io.h>
+#include <string.h>
 
 #include "task.h"
 
+#if TASK_DEFER
+#include "ring.h"
+#endif
+
+#if TASK_PT
+#include "pt.h"
+#endif
+
+#if TASK_SIM
+#include "sim.h"
+#endif
+
 // Pointer to current task.
 // May only be changed by schedule routine.
 static task_t *_task__current = 0;
 
-// Queue with runnable tasks.
+// Queues with runnable tasks, one per priority level.
 // Holds tasks that may be scheduled immediately.
-static QUEUE _tasks__runnable;
+static QUEUE _tasks__runnable[TASK_PRIO_COUNT];
+
+// Bitmap of priority levels with a non-empty runnable queue.
+static uint8_t _tasks__ready = 0;
+
+// Set when task_wakeup_pending woke up a task with a higher priority than the
+// current one. Cleared when the scheduler picks the next task.
+static uint8_t _task__yield_pending = 0;
 
 // Queue with suspended tasks.
 // Holds tasks that called "task_suspend".
@@ -19,6 +39,72 @@ static QUEUE _tasks__suspended;
 // Holds tasks that called "task_sleep".
 static QUEUE _tasks__sleeping;
 
+// Queue with tasks declared with TASK_DEFINE.
+// Holds tasks created before task_init. Statically initialized, because
+// these tasks are created before main() runs.
+static QUEUE _tasks__static = { &_tasks__static, &_tasks__static };
+
+#if !TASK_SIM
+// Stack for the scheduler and for interrupt handlers that run while the
+// processor is idle.
+static uint8_t _task__scheduler_stack[TASK_SCHEDULER_STACK_SIZE];
+#endif
+
+// Task waiting in task_usleep. Lives on the stack of task_usleep.
+struct task__usleeper {
+  QUEUE member; // Member of _tasks__usleeping.
+  task_t *task;
+  uint16_t target; // Low bits of task__counts() to wake up at.
+};
+
+// Tasks waiting in task_usleep, ordered by target. The TIMER0 compare B
+// interrupt fires at the target count of the first one.
+static QUEUE _tasks__usleeping;
+
+#if TASK_TICKLESS
+// Set while the timer runs with a stretched period.
+static uint8_t _task__tickless = 0;
+
+// Timer count, and Timer1 in timer counts (see task__t1_counts), when the
+// period was stretched.
+static uint8_t _task__tickless_counts;
+static uint16_t _task__tickless_t1;
+#endif
+
+// Number of ticks since the task timer was started.
+static uint32_t _task__ticks = 0;
+
+#if TASK_SLEEP_ADC
+// Set to sleep in ADC Noise Reduction mode instead of Idle mode.
+static volatile uint8_t _task__adc_sleep = 0;
+
+// Time the I/O clock was stopped for that wasn't added to the timer yet, in
+// Timer4 counts.
+static int16_t _task__adc_lost = 0;
+#endif
+
+#if TASK_STATS
+// Timer counts at the last time the scheduler ran.
+static uint32_t _task__stamp = 0;
+
+// Timer counts spent without a running task.
+static uint32_t _task__idle = 0;
+
+// Set if the current task is switched out involuntarily.
+static uint8_t _task__preempting = 0;
+#endif
+
+uint32_t task_now(void) {
+  uint8_t sreg = SREG;
+  uint32_t t;
+
+  cli();
+  t = _task__ticks;
+  SREG = sreg;
+
+  return t;
+}
+
 #if TASK_COUNT_SEC
 static TASK_SEC_T _task_sec = 0;
 
@@ -71,6 +157,50 @@ void task_set_usec(TASK_USEC_T t) {
 }
 #endif // TASK_COUNT_USEC
 
+// Saved frames come in two formats, marked by the byte on top of the frame.
+//
+// A full frame (marker 0) holds all 32 general registers and the status
+// register, 34 bytes with the marker. It is pushed when a task is
+// interrupted, or when it is created.
+//
+// A cooperative frame (marker 1) holds the status register and only the
+// registers that the avr-gcc ABI expects a function call to preserve
+// (r2-r17 and r28-r29), 20 bytes with the marker. It is pushed when a task
+// calls task_yield.
+//
+// Counted from the instructions below, at 2 cycles per push and pop:
+// task_yield saves a cooperative frame in 53 cycles, and task__pop restores
+// it in 62 (61 if interrupts stay disabled). task__push saves a full frame
+// in 85 cycles, and task__pop restores it in 94 (90). A round trip through
+// a cooperative frame takes 115 cycles instead of 179. None of this
+// includes the call or interrupt entry, or the scheduler in between.
+//
+#define TASK_FRAME_FULL 0
+#define TASK_FRAME_COOPERATIVE 1
+
+#if TASK_SIM
+// The simulator runs every task on a host stack of its own and switches
+// between them with host contexts. A task's sp points to its context.
+// The scheduler runs on the stack of main().
+static sim_context_t *_task__scheduler_ctx;
+
+// Create initial context of a task.
+static void *task__internal_initialize(void *sp, task_fn fn, void *data) {
+  return sim_context_create(fn, data);
+}
+
+// Switch from the current task to the scheduler.
+// Returns when the task is scheduled again, with the status register it
+// had when it switched out.
+static void task__switch(void) {
+  uint8_t sreg = SREG;
+
+  cli();
+  sim_context_switch(_task__current->sp, _task__scheduler_ctx);
+
+  SREG = sreg;
+}
+#else
 // Push a task's context onto its own stack.
 static inline void task__push(void) __attribute__ ((always_inline));
 static inline void task__push(void) {
@@ -145,6 +275,9 @@ static inline void task__push(void) {
     // the register may temporarily hold a non-zero value.
     "clr r1\n"
 
+    // Mark frame as full frame
+    "push r1\n"
+
     // Save stack pointer in current task struct
     "in r0, 0x3d\n" // Low
     "st z+, r0\n"
@@ -167,7 +300,47 @@ static void task__pop(void) {
     "ld r0, x+\n"
     "out 0x3e, r0\n" // High
 
-    // Restore general registers
+    // Branch on frame format
+    "pop r0\n"
+    "tst r0\n"
+    "breq 1f\n"
+
+    // Restore call-saved registers of cooperative frame
+    "pop r29\n"
+    "pop r28\n"
+    "pop r17\n"
+    "pop r16\n"
+    "pop r15\n"
+    "pop r14\n"
+    "pop r13\n"
+    "pop r12\n"
+    "pop r11\n"
+    "pop r10\n"
+    "pop r9\n"
+    "pop r8\n"
+    "pop r7\n"
+    "pop r6\n"
+    "pop r5\n"
+    "pop r4\n"
+    "pop r3\n"
+    "pop r2\n"
+    "clr r1\n"
+
+    // Restore status register. Like for full frames below, RETI is used to
+    // re-enable interrupts. Register r0 is call-clobbered and not restored.
+    "pop r0\n"
+    "sbrs r0, 7\n" // Skip if bit in register set
+    "rjmp 2f\n"
+    "clt\n" // Clear T in SREG
+    "bld r0, 7\n" // Bit load from T to r0 bit 7 (interrupt bit)
+    "out 0x3f, r0\n" // Restore status register (without interrupt bit set)
+    "reti\n"
+  "2:\n"
+    "out 0x3f, r0\n" // Restore status register
+    "ret\n"
+
+  "1:\n"
+    // Restore general registers of full frame
     "pop r29\n"
     "pop r28\n"
     "pop r27\n"
@@ -314,6 +487,9 @@ static void *task__internal_initialize(void *sp, task_fn fn, void *data) {
     "push r19\n" // r28
     "push r19\n" // r29
 
+    // Mark frame as full frame
+    "push r19\n"
+
     // Store new task's stack pointer at return register
     "in %A0, 0x3d\n"
     "in %B0, 0x3e\n"
@@ -332,23 +508,138 @@ static void *task__internal_initialize(void *sp, task_fn fn, void *data) {
 
   return result;
 }
+#endif // TASK_SIM
 
-// Creates a task for the specified function.
-task_t *task__internal_create(task_fn fn, void *data) {
-  static void *start = (void *)RAMEND;
-  void *sp;
-  task_t *t;
+// Return index of the most significant bit that is set.
+static inline uint8_t task__highest(uint8_t x) {
+  uint8_t i = 0;
+
+  if (x & 0xf0) {
+    x >>= 4;
+    i += 4;
+  }
+  if (x & 0x0c) {
+    x >>= 2;
+    i += 2;
+  }
+  if (x & 0x02) {
+    i += 1;
+  }
+
+  return i;
+}
+
+// Add task to the tail of the runnable queue for its priority.
+// Must be called with interrupts disabled.
+static void task__ready(task_t *t) {
+  QUEUE_INSERT_TAIL(&_tasks__runnable[t->prio], &t->member);
+  _tasks__ready |= _BV(t->prio);
+}
+
+// Remove current task from its runnable queue.
+// Must be called with interrupts disabled.
+static void task__unready(void) {
+  task_t *t = _task__current;
+
+  QUEUE_REMOVE(&t->member);
+  if (QUEUE_EMPTY(&_tasks__runnable[t->prio])) {
+    _tasks__ready &= ~_BV(t->prio);
+  }
+}
+
+#if TASK_SIM
+// Tasks created at run time are carved from simulated RAM.
+#define TASK_HEAP_START (sim_ram)
+#define TASK_HEAP_END (sim_ram + SIM_RAM_SIZE)
+#else
+// Start of the heap, i.e. the end of statically allocated memory.
+// Provided by the linker script.
+extern uint8_t __heap_start;
+
+#define TASK_HEAP_START (&__heap_start)
+
+// main() runs on the stack at the top of RAM until task_start, so tasks
+// created before then leave the top 0x100 bytes alone. Nothing runs on that
+// stack after task_start, so tasks created later may use all of RAM.
+#define TASK_HEAP_END ((uint8_t *)(RAMEND - 0x100))
+#define TASK_HEAP_END_STARTED ((uint8_t *)(RAMEND + 1))
+#endif
+
+// End of the RAM that is left for tasks created at run time.
+static uint8_t *_task__heap_end = TASK_HEAP_END;
 
-  // Should protect this against underflow.
-  start -= 0x100;
+// Initialize task with the specified stack.
+static void task__setup(task_t *t, uint8_t *stack, uint16_t stack_size, task_fn fn, void *data) {
+  uint8_t *p;
 
-  // Stack grows down, don't overwrite first byte of task struct.
-  t = start - sizeof(task_t);
-  sp = (void *)t - 1;
+  // Paint stack so that its high-water mark can be found later.
+  // The lowest byte holds a canary that is checked on every tick.
+  for (p = stack; p < stack + stack_size; p++) {
+    *p = TASK_STACK_PAINT;
+  }
+  stack[0] = TASK_STACK_CANARY;
 
-  t->sp = task__internal_initialize(sp, fn, data);
+  // Stack grows down from its last byte.
+  t->sp = task__internal_initialize(stack + stack_size - 1, fn, data);
   t->delay = 0;
+  t->stack = stack;
+  t->stack_size = stack_size;
+  t->woken = 0;
+  t->locks = 0;
   QUEUE_INIT(&t->member);
+  QUEUE_INIT(&t->wait);
+
+#if TASK_STATS
+  t->stats = (task_stats_t) { 0 };
+#endif
+}
+
+// Creates a task for the specified function.
+// Returns NULL if there is not enough memory left for its stack.
+task_t *task__internal_create(task_fn fn, void *data, uint16_t stack_size) {
+  uint8_t *stack;
+  task_t *t;
+
+  // Don't carve into statically allocated memory.
+  if ((uint16_t)(_task__heap_end - TASK_HEAP_START) < sizeof(task_t) + stack_size) {
+    return 0;
+  }
+
+  // Task struct sits right above its stack.
+  t = (task_t *)(_task__heap_end - sizeof(task_t));
+  stack = (uint8_t *)t - stack_size;
+  _task__heap_end = stack;
+
+  task__setup(t, stack, stack_size, fn, data);
+
+  return t;
+}
+
+// Initializes task declared with TASK_DEFINE.
+// Runs from the .init8 section, before main() and before task_init.
+void task__static_create(task_t *t, uint8_t *stack, uint16_t stack_size, task_fn fn, void *data, uint8_t prio) {
+  task__setup(t, stack, stack_size, fn, data);
+  t->prio = prio;
+  t->base_prio = prio;
+
+  // Made runnable by task_init.
+  QUEUE_INSERT_TAIL(&_tasks__static, &t->member);
+}
+
+// Creates a task and adds it to the runnable queue for its priority.
+static task_t *task__create(task_fn fn, void *data, uint16_t stack_size, uint8_t prio) {
+  task_t *t = task__internal_create(fn, data, stack_size);
+  uint8_t sreg = SREG;
+
+  if (t == 0) {
+    return 0;
+  }
+
+  cli();
+  t->prio = prio;
+  t->base_prio = prio;
+  task__ready(t);
+  SREG = sreg;
 
   return t;
 }
@@ -356,77 +647,475 @@ task_t *task__internal_create(task_fn fn, void *data) {
 // Creates a task for the specified function.
 // Adds it to the list of user tasks.
 task_t *task_create(task_fn fn, void *data) {
-  task_t *t = task__internal_create(fn, data);
+  return task_create_prio(fn, data, TASK_PRIO_DEFAULT);
+}
 
-  QUEUE_INSERT_TAIL(&_tasks__runnable, &t->member);
+// Creates a task for the specified function with the specified priority.
+// Adds it to the list of user tasks.
+task_t *task_create_prio(task_fn fn, void *data, uint8_t prio) {
+  if (prio >= TASK_PRIO_COUNT) {
+    return 0;
+  }
 
-  return t;
+  return task__create(fn, data, TASK_STACK_SIZE, prio);
 }
 
-static void task__tick() {
-  QUEUE *q, *r;
+// Creates a task for the specified function with the specified stack size.
+// Adds it to the list of user tasks.
+task_t *task_create_ex(task_fn fn, void *data, uint16_t stack_size) {
+  return task__create(fn, data, stack_size, TASK_PRIO_DEFAULT);
+}
+
+// Return number of stack bytes that have never been used.
+uint16_t task_stack_free(task_t *t) {
+  uint16_t n;
+
+  // Skip the canary.
+  for (n = 1; n < t->stack_size; n++) {
+    if (t->stack[n] != TASK_STACK_PAINT) {
+      break;
+    }
+  }
+
+  return n - 1;
+}
+
+// Return high-water mark of stack usage in bytes.
+uint16_t task_stack_used(task_t *t) {
+  return t->stack_size - task_stack_free(t);
+}
+
+// Called from the tick when the stack canary of a task was overwritten.
+// Halts the processor. Applications can define their own handler.
+void task_stack_overflow(task_t *t) __attribute__((weak));
+void task_stack_overflow(task_t *t) {
+  cli();
+  for (;;) {
+  }
+}
+
+// Remove task from the sleeping queue.
+// The sleeping queue is a delta list: every task's delay is relative to the
+// task in front of it. A task that leaves the queue early hands its remaining
+// delay to its successor so that the successor's deadline doesn't move.
+// Must be called with interrupts disabled.
+static void task__unsleep(task_t *t) {
+  QUEUE *q = QUEUE_NEXT(&t->member);
+
+  if (q != &_tasks__sleeping) {
+    QUEUE_DATA(q, task_t, member)->delay += t->delay;
+  }
+
+  t->delay = 0;
+}
+
+// Insert current task in the sleeping queue, ordered by deadline.
+// Tasks with equal deadlines are woken up in the order they went to sleep.
+// Must be called with interrupts disabled.
+static void task__sleep(uint16_t delay) {
+  QUEUE *q;
   task_t *t;
 
-#if TASK_COUNT_SEC
-  if (--_task_sec_countdown == 0) {
-    _task_sec++;
-    _task_sec_countdown = 1000 / MS_PER_TICK;
+  QUEUE_FOREACH(q, &_tasks__sleeping) {
+    t = QUEUE_DATA(q, task_t, member);
+    if (delay < t->delay) {
+      t->delay -= delay;
+      break;
+    }
+
+    delay -= t->delay;
+  }
+
+  t = _task__current;
+  t->delay = delay;
+  task__unready();
+
+  // Insert before q (or at the tail if the loop ran to completion).
+  QUEUE_INSERT_TAIL(q, &t->member);
+}
+
+// Move task to the runnable queue.
+// Doesn't preempt the current task; the caller is responsible for that.
+// Must be called with interrupts disabled.
+static void task__wakeup(task_t *t) {
+  // A non-zero delay means the task is on the sleeping queue.
+  if (t->delay) {
+    task__unsleep(t);
+  }
+
+  // A task waiting with a timeout is also on a wait queue.
+  if (!QUEUE_EMPTY(&t->wait)) {
+    QUEUE_REMOVE(&t->wait);
+    QUEUE_INIT(&t->wait);
+  }
+
+  QUEUE_REMOVE(&t->member);
+  task__ready(t);
+}
+
+// Wake up every task at the head of the sleeping queue whose deadline has
+// passed. Must be called with interrupts disabled.
+static void task__wake_due(void) {
+  task_t *t;
+
+  while (!QUEUE_EMPTY(&_tasks__sleeping)) {
+    t = QUEUE_DATA(QUEUE_HEAD(&_tasks__sleeping), task_t, member);
+    if (t->delay) {
+      break;
+    }
+
+    task__wakeup(t);
   }
+}
+
+// Advance clocks and sleeping tasks by the specified number of ticks.
+static void task__advance(uint8_t n) {
+  for (; n > 0; n--) {
+    _task__ticks++;
+
+#if TASK_COUNT_SEC
+    if (--_task_sec_countdown == 0) {
+      _task_sec++;
+      _task_sec_countdown = 1000 / MS_PER_TICK;
+    }
 #endif
 
 #if TASK_COUNT_MSEC
-  _task_msec += MS_PER_TICK;
+    _task_msec += MS_PER_TICK;
 #endif
 
 #if TASK_COUNT_USEC
-  _task_usec += US_PER_TICK;
+    _task_usec += US_PER_TICK;
 #endif
 
-  q = QUEUE_NEXT(&_tasks__sleeping);
-  r = 0;
-  for (; q != &_tasks__sleeping; q = r) {
-    // Save pointer to next element so q can be
-    // removed without breaking iteration.
-    r = QUEUE_NEXT(q);
-    t = QUEUE_DATA(q, task_t, member);
+    // Tasks that slept for 0 ticks since the last tick are at the head with
+    // a delay of 0. Wake them up first: decrementing past them would leave
+    // the delay of every other task untouched for as long as some task
+    // keeps sleeping for 0 ticks.
+    task__wake_due();
+    if (QUEUE_EMPTY(&_tasks__sleeping)) {
+      continue;
+    }
 
-    if (t->delay) {
-      t->delay--;
+    // Only the head of the delta list has to be decremented.
+    QUEUE_DATA(QUEUE_HEAD(&_tasks__sleeping), task_t, member)->delay--;
+    task__wake_due();
+  }
+}
+
+#if TASK_TICKLESS || TASK_SLEEP_ADC
+// Timer1 runs at F_CPU/8 off the prescaler it shares with TIMER0, and was
+// started in step with it (see task__setup_timer). It counts the time the
+// timer spends at the coarser prescaler, to the regular timer count.
+#define TASK__T1_PER_COUNT ((F_CPU / 1000000) * US_PER_COUNT / 8)
+
+// Return Timer1 in regular timer counts, which wraps at this mask.
+// TIMER0 counts, at either prescaler, whenever this value changes to a
+// multiple of the prescaler ratio.
+#define TASK__T1_COUNTS_MASK (UINT16_MAX / TASK__T1_PER_COUNT)
+static uint16_t task__t1_counts(void) {
+  return TCNT1 / TASK__T1_PER_COUNT;
+}
+
+// Return the timer count, and store Timer1 taken within the same count.
+static uint8_t task__t0_take(uint16_t *t1) {
+  uint8_t counts;
+
+  do {
+    counts = TCNT0;
+    *t1 = task__t1_counts();
+  } while (TCNT0 != counts);
+
+  return counts;
+}
+
+// Set the timer at the regular prescaler to the specified count, taken when
+// Timer1 was at the specified value, plus what it counted since.
+// Returns the count it was set to, before wrapping it to a tick.
+static uint16_t task__t0_resume(uint16_t counts, uint16_t t1_then) {
+  uint16_t now;
+  uint16_t t1;
+
+  // Try again if the timer counted in the meantime. Writing TCNT0 blocks
+  // the compare match for a timer clock, so the last count of a tick can't
+  // be written: wait for the next one instead.
+  for (;;) {
+    t1 = task__t1_counts();
+    now = counts + ((t1 - t1_then) & TASK__T1_COUNTS_MASK);
+    if (now % COUNTS_PER_TICK != COUNTS_PER_TICK - 1) {
+      TCNT0 = now % COUNTS_PER_TICK;
+      if (task__t1_counts() == t1) {
+        return now;
+      }
     }
+  }
+}
+#endif
+
+#if TASK_TICKLESS
+// Stretch the timer period up to the deadline of the first sleeping task.
+// Called from the scheduler, with interrupts disabled, right before it
+// puts the processor to sleep.
+static void task__tickless_start(void) {
+  uint16_t delay = UINT16_MAX;
+  uint16_t counts;
+  uint16_t t1;
+  uint8_t periods;
+  uint8_t first;
+
+  // Changing the prescaler would break a pending microsecond sleep, and the
+  // interrupt of a tick that already passed has to run at the regular period.
+  if (!QUEUE_EMPTY(&_tasks__usleeping) || (TIFR0 & _BV(OCF0A))) {
+    return;
+  }
+
+  if (!QUEUE_EMPTY(&_tasks__sleeping)) {
+    delay = QUEUE_DATA(QUEUE_HEAD(&_tasks__sleeping), task_t, member)->delay;
+  }
+
+  // A stretched period covers TICKLESS_RATIO ticks.
+  periods = (delay < TICKLESS_RATIO * TICKLESS_MAX_PERIODS)
+    ? delay / TICKLESS_RATIO
+    : TICKLESS_MAX_PERIODS;
+  if (periods == 0) {
+    return;
+  }
+
+  _task__tickless_counts = task__t0_take(&t1);
+
+  // End the period at the first count of the coarser prescaler at or after
+  // the deadline. Its first count comes when Timer1 reaches a multiple of
+  // the ratio; every other count takes a full ratio.
+  counts = periods * TICKLESS_RATIO * COUNTS_PER_TICK - _task__tickless_counts;
+  first = TICKLESS_RATIO - (t1 % TICKLESS_RATIO);
+  _task__tickless_t1 = t1;
+  _task__tickless = 1;
+  TCCR0B = _TCCR0B_TICKLESS;
+  TCNT0 = 0;
+  OCR0A = (counts - first + TICKLESS_RATIO - 1) / TICKLESS_RATIO;
+}
+
+// Restore the regular tick period.
+// Returns the number of ticks that passed since it was stretched, including
+// the one that ended the period if it expired.
+static uint8_t task__tickless_stop(void) {
+  uint16_t counts;
+
+  TCCR0B = _TCCR0B;
+  OCR0A = COUNTS_PER_TICK - 1;
+
+  // Carry on from the count Timer1 arrived at.
+  counts = task__t0_resume(_task__tickless_counts, _task__tickless_t1);
+
+  // The end of the period is counted above if it passed.
+  TIFR0 = _BV(OCF0A);
+  _task__tickless = 0;
+  return counts / COUNTS_PER_TICK;
+}
+#endif // TASK_TICKLESS
+
+static void task__tick() {
+  uint8_t n = 1;
+
+  // Trap if the interrupted task overflowed its stack.
+  if (_task__current && _task__current->stack[0] != TASK_STACK_CANARY) {
+    task_stack_overflow(_task__current);
+  }
+
+#if TASK_TICKLESS
+  // The timer interrupt fired at the end of a stretched period.
+  if (_task__tickless) {
+    n = task__tickless_stop();
+  }
+#endif
+
+  task__advance(n);
+}
+
+// Return number of timer counts since the task timer was started.
+// Must be called with interrupts disabled, outside of a stretched period.
+static uint32_t task__counts(void) {
+  uint8_t counts = TCNT0;
+  uint32_t ticks = _task__ticks;
+
+  // The timer may have wrapped without the tick interrupt having run yet.
+  if ((TIFR0 & _BV(OCF0A)) && counts < (COUNTS_PER_TICK / 2)) {
+    ticks++;
+  }
 
-    if (t->delay == 0) {
-      task_wakeup(t);
+  return (ticks * COUNTS_PER_TICK) + counts;
+}
+
+#if TASK_STATS
+// Charge the time since the scheduler last ran to the task that was running,
+// or to the idle accumulator if no task was running.
+static void task__account(void) {
+  uint32_t now = task__counts();
+  uint32_t delta = now - _task__stamp;
+  task_t *t = _task__current;
+
+  _task__stamp = now;
+
+  if (t == 0) {
+    _task__idle += delta;
+  } else {
+    t->stats.run_counts += delta;
+    if (_task__preempting) {
+      t->stats.preempted++;
+    } else {
+      t->stats.yielded++;
     }
   }
+
+  // The tick interrupt sets this while idle too.
+  _task__preempting = 0;
+}
+#endif // TASK_STATS
+
+// Put the processor to sleep in the specified sleep mode (SMCR) until an
+// interrupt was handled. Returns with interrupts disabled, unless the task
+// timer woke it up: on the device, that handler jumps to the scheduler.
+static void task__idle(uint8_t mode) {
+  SMCR = mode;
+
+#if TASK_SIM
+  sim_sleep();
+#else
+  sei();
+  asm volatile ("sleep");
+#endif
+  cli();
+}
+
+#if TASK_SLEEP_ADC
+// Timer1 and Timer4 counts per microsecond.
+#define TASK__T1_PER_US (F_CPU / 8000000)
+#define TASK__T4_PER_US 4
+
+// Timer4 counts per timer count.
+#define TASK__T4_PER_COUNT (TASK__T4_PER_US * US_PER_COUNT)
+
+// The PLL takes 8 MHz: divide a 16 MHz clock by 2.
+#if F_CPU == 16000000L
+#define TASK__PLLCSR _BV(PINDIV)
+#else
+#define TASK__PLLCSR 0
+#endif
+
+// Return Timer4 right after Timer1 counted, and store Timer1.
+// Both count off the same crystal, so taking them at the same point of a
+// Timer1 count keeps the difference between two calls from being skewed by
+// where in a count each one was called.
+static uint16_t task__t4_take(uint16_t *t1) {
+  uint16_t t4;
+  uint16_t then = TCNT1;
+
+  while ((*t1 = TCNT1) == then) {
+  }
+
+  // Reading the low byte latches the high byte of the 10-bit counter.
+  t4 = TCNT4;
+  return t4 | (TC4H << 8);
+}
+
+// Sleep in ADC Noise Reduction mode until the conversion that entering it
+// starts completes. The I/O clock stops, and with it TIMER0 and Timer1, but
+// Timer4 keeps counting off the PLL. The timer is moved on by the time
+// Timer4 counted and Timer1 didn't.
+static void task__idle_adc(void) {
+  uint16_t t1;
+  uint16_t t1_then;
+  uint16_t t4;
+  uint16_t counts;
+
+  t4 = task__t4_take(&t1_then);
+  task__idle(_BV(SM0) | _BV(SE));
+  t4 = (task__t4_take(&t1) - t4) & 0x3ff;
+  t1 -= t1_then;
+
+  // A sleep lasts at most as long as the first conversion after enabling the
+  // ADC, 25 ADC clocks (200 us), so the 10 bits of Timer4 cover it.
+  _task__adc_lost += (int16_t)(t4 - t1 * (TASK__T4_PER_US / TASK__T1_PER_US));
+  if (_task__adc_lost < TASK__T4_PER_COUNT) {
+    return;
+  }
+
+  // The timer may have wrapped without the tick interrupt having run yet
+  // (see task__counts).
+  counts = task__t0_take(&t1);
+  if ((TIFR0 & _BV(OCF0A)) && counts < (COUNTS_PER_TICK / 2)) {
+    counts += COUNTS_PER_TICK;
+  }
+
+  counts = task__t0_resume(counts + _task__adc_lost / TASK__T4_PER_COUNT, t1);
+  _task__adc_lost %= TASK__T4_PER_COUNT;
+
+  // The ticks the timer passed are counted here.
+  TIFR0 = _BV(OCF0A);
+  task__advance(counts / COUNTS_PER_TICK);
 }
+#endif
 
 static void task__scheduler(void) {
-  // Overwrite stack pointer to RAMEND.
+#if !TASK_SIM
+  // Overwrite stack pointer to top of scheduler stack.
   // The task scheduler runs in its own piece of stack to prevent polluting (or
   // even overflowing) task stacks when interrupt handlers are executed.
   asm volatile(
     "out 0x3d, %A0\n"
     "out 0x3e, %B0\n"
-    :: "x" (RAMEND)
+    :: "x" (&_task__scheduler_stack[TASK_SCHEDULER_STACK_SIZE - 1])
   );
+#endif
 
   for (;;) {
+    QUEUE *h;
     QUEUE *q;
 
+#if TASK_TICKLESS
+    // Another interrupt woke the processor up before the stretched period
+    // ended. Sleep on unless it made a task runnable, and catch up if it did.
+    if (_task__tickless) {
+      while (_task__tickless && !_tasks__ready) {
+        task__idle(_BV(SE));
+      }
+      if (_task__tickless) {
+        task__advance(task__tickless_stop());
+      }
+    }
+#endif
+
+#if TASK_STATS
+    task__account();
+#endif
+
     // No task is currently running.
     _task__current = 0;
+    _task__yield_pending = 0;
 
     // Find task to schedule, if any.
-    QUEUE_FOREACH(q, &_tasks__runnable) {
-      // The first runnable task can be scheduled.
+    if (_tasks__ready) {
+      // The first task in the highest priority runnable queue can be scheduled.
+      h = &_tasks__runnable[task__highest(_tasks__ready)];
+      q = QUEUE_HEAD(h);
       _task__current = QUEUE_DATA(q, task_t, member);
 
+#if TASK_STATS
+      _task__current->stats.scheduled++;
+#endif
+
       // Make [head..q] the new tail, so that q->next can be scheduled next.
-      QUEUE_ROTATE(&_tasks__runnable, q);
+      QUEUE_ROTATE(h, q);
 
+#if TASK_SIM
+      // Returns when the task switches back to the scheduler.
+      sim_context_switch(_task__scheduler_ctx, _task__current->sp);
+      continue;
+#else
       // This function doesn't continue execution beyond this point.
       // The task__pop function RETs back into the task.
       task__pop();
+#endif
     }
 
     // The processor wakes up from sleep to handle interrupts.
@@ -439,12 +1128,40 @@ static void task__scheduler(void) {
     // after the handler has executed, and this function continues execution.
     //
 
-    sei();
-    asm volatile ("sleep");
-    cli();
+#if TASK_SLEEP_ADC
+    // The timer doesn't run in ADC Noise Reduction mode, so it can only be
+    // woken up by the ADC (case 2). Stretching the period would be pointless.
+    if (_task__adc_sleep) {
+      task__idle_adc();
+      continue;
+    }
+#endif
+
+#if TASK_TICKLESS
+    task__tickless_start();
+#endif
+
+    // Idle mode keeps the timers running.
+    task__idle(_BV(SE));
   }
 }
 
+#if TASK_SIM
+// The tick interrupt handler switches to the scheduler and returns when the
+// interrupted task is resumed. If no task was running, it returns to the
+// scheduler right away.
+ISR(TIMER0_COMPA_vect) {
+#if TASK_STATS
+  _task__preempting = 1;
+#endif
+
+  task__tick();
+
+  if (_task__current) {
+    task__switch();
+  }
+}
+#else
 static void task__jmp_scheduler(void) {
   asm volatile ("ijmp" :: "z" (task__scheduler));
 }
@@ -454,6 +1171,10 @@ static void task__yield_from_timer(void) __attribute__((naked));
 static void task__yield_from_timer(void) {
   task__push();
 
+#if TASK_STATS
+  _task__preempting = 1;
+#endif
+
   task__tick();
 
   task__jmp_scheduler();
@@ -470,10 +1191,16 @@ ISR(TIMER0_COMPA_vect, ISR_NAKED) {
   // interrupt handler. Hence, the RETI.
   asm volatile ("reti");
 }
+#endif // TASK_SIM
 
 // Use TIMER0 for OS ticks.
 // Configure it to trigger a Output Compare Register interrupt every 2ms.
 static void task__setup_timer() {
+#if TASK_TICKLESS || TASK_SLEEP_ADC
+  // Hold the prescaler in reset while the timers are set up.
+  GTCCR = _BV(TSM) | _BV(PSRSYNC);
+#endif
+
   // Waveform generation mode: CTC
   // WGM02: 0
   // WGM01: 1
@@ -485,15 +1212,203 @@ static void task__setup_timer() {
 
   // Output compare register
   OCR0A = COUNTS_PER_TICK - 1;
+
+#if TASK_TICKLESS || TASK_SLEEP_ADC
+  // Run TIMER1 freely at F_CPU/8 to count the time spent at the coarser
+  // prescaler (see task__tickless_stop), and the time the I/O clock runs
+  // during an ADC Noise Reduction sleep.
+  TCCR1A = 0;
+  TCCR1B = _BV(CS11);
+#endif
+
+#if TASK_SLEEP_ADC
+  // Run Timer4 freely at 4 MHz off the PLL, which keeps running in ADC Noise
+  // Reduction mode: 48 MHz, divided by 1.5 for the timer and by 8.
+  PLLCSR = TASK__PLLCSR | _BV(PLLE);
+  PLLFRQ = _BV(PLLTM1) | _BV(PDIV2);
+  while (!(PLLCSR & _BV(PLOCK))) {
+  }
+
+  // Count through all 10 bits: the top is OCR4C, with TC4H as its high byte.
+  TC4H = 0x3;
+  OCR4C = 0xff;
+  TCCR4B = _BV(CS42);
+#endif
+
+#if TASK_TICKLESS || TASK_SLEEP_ADC
+  // Start both timers on a reset of the prescaler they share, so that
+  // Timer1 counts in step with TIMER0.
+  TCNT1 = 0;
+  GTCCR = 0;
+#endif
+}
+
+#if TASK_DEFER
+RING_DECLARE(task__work_ring, task_work_t, TASK_DEFER_SIZE)
+
+// Deferred work items, posted by interrupt handlers.
+static task__work_ring_t _task__work;
+
+// Runs deferred work items in order.
+static void task__defer_worker(void *unused) {
+  task_work_t w;
+
+  for (;;) {
+    task__work_ring_pop_wait(&_task__work, &w);
+    w.fn(w.arg);
+  }
+}
+
+TASK_DEFINE(_task__defer, task__defer_worker, 0, TASK_DEFER_STACK_SIZE, TASK_PRIO_COUNT - 1);
+
+// Post work item to the deferred work queue.
+uint8_t task_defer(task_work_fn fn, void *arg) {
+  task_work_t w = { .fn = fn, .arg = arg };
+
+  return task__work_ring_push(&_task__work, &w);
+}
+#endif // TASK_DEFER
+
+#if TASK_PT
+// Protothreads run by the host task.
+// Statically initialized so that protothreads can be started before task_init.
+static QUEUE _tasks__pt = { &_tasks__pt, &_tasks__pt };
+
+// Runs protothreads until they end.
+// A pass calls every protothread that isn't sleeping. If none of them yielded,
+// the host sleeps until the earliest wake up time of the sleeping ones. If
+// any of them is waiting for a condition, it sleeps for at most
+// TASK_PT_POLL_MS, or until task_pt_poll wakes it up.
+static void task__pt_host(void *unused) {
+  QUEUE *q;
+  QUEUE *r;
+  pt_t *pt;
+  uint32_t now;
+  uint32_t wake;
+  int32_t delay;
+  uint8_t yielded;
+  uint8_t waiting;
+  uint8_t sreg;
+
+  for (;;) {
+    now = task_now();
+    wake = now + UINT16_MAX;
+    yielded = 0;
+    waiting = 0;
+
+    for (q = QUEUE_NEXT(&_tasks__pt); q != &_tasks__pt; q = r) {
+      // Save pointer to next element so q can be removed.
+      r = QUEUE_NEXT(q);
+      pt = QUEUE_DATA(q, pt_t, member);
+
+      if (pt->state != PT_SLEEPING || (int32_t)(now - pt->wake) >= 0) {
+        pt->state = pt->fn(pt);
+      }
+
+      switch (pt->state) {
+      case PT_WAITING:
+        waiting = 1;
+        break;
+      case PT_YIELDED:
+        yielded = 1;
+        break;
+      case PT_SLEEPING:
+        if ((int32_t)(pt->wake - wake) < 0) {
+          wake = pt->wake;
+        }
+        break;
+      case PT_ENDED:
+        sreg = SREG;
+        cli();
+        QUEUE_REMOVE(q);
+        SREG = sreg;
+        break;
+      }
+    }
+
+    if (yielded) {
+      task_yield();
+      continue;
+    }
+
+    // Sleep until the earliest wake up time. Unlike task_sleep_until, return
+    // when woken up early, because task_pt_start and task_pt_poll wake up
+    // the host.
+    sreg = SREG;
+    cli();
+    delay = wake - _task__ticks;
+    if (waiting && delay > TASK_MSEC_TO_TICKS(TASK_PT_POLL_MS)) {
+      delay = TASK_MSEC_TO_TICKS(TASK_PT_POLL_MS);
+    }
+    task__sleep((delay > 0) ? delay : 0);
+    task_yield();
+    SREG = sreg;
+  }
+}
+
+TASK_DEFINE(_task__pt, task__pt_host, 0, TASK_PT_STACK_SIZE, TASK_PRIO_DEFAULT);
+
+// Start running protothread.
+void task_pt_start(pt_t *pt, pt_fn fn) {
+  uint8_t sreg = SREG;
+
+  pt->lc = 0;
+  pt->state = PT_YIELDED;
+  pt->fn = fn;
+
+  cli();
+  QUEUE_INSERT_TAIL(&_tasks__pt, &pt->member);
+
+  // Wake up the host if it is sleeping.
+  if (_task__current) {
+    task_wakeup(&_task__pt);
+  }
+
+  SREG = sreg;
 }
 
+// Wake up the host to poll waiting protothreads.
+void task_pt_poll(void) {
+  uint8_t sreg = SREG;
+
+  task_wakeup_pending(&_task__pt);
+  if (sreg & _BV(SREG_I)) {
+    task_yield_pending();
+  }
+}
+#endif // TASK_PT
+
 void task_init(void) {
-  QUEUE_INIT(&_tasks__runnable);
+  QUEUE *q;
+  task_t *t;
+  uint8_t i;
+
+  for (i = 0; i < TASK_PRIO_COUNT; i++) {
+    QUEUE_INIT(&_tasks__runnable[i]);
+  }
+
   QUEUE_INIT(&_tasks__suspended);
   QUEUE_INIT(&_tasks__sleeping);
+  QUEUE_INIT(&_tasks__usleeping);
+
+  // Make tasks declared with TASK_DEFINE runnable.
+  while (!QUEUE_EMPTY(&_tasks__static)) {
+    q = QUEUE_HEAD(&_tasks__static);
+    t = QUEUE_DATA(q, task_t, member);
+    QUEUE_REMOVE(q);
+    task__ready(t);
+  }
 
   task__setup_timer();
 
+#if TASK_SIM
+  _task__scheduler_ctx = sim_context_create(0, 0);
+#endif
+
+#if TASK_DEFER
+  task__work_ring_init(&_task__work);
+#endif
+
 #if TASK_COUNT_SEC
   task_set_sec(0);
 #endif
@@ -516,17 +1431,95 @@ void task_start(void) {
   // Enable interrupt on OCR0A match
   TIMSK0 |= _BV(OCIE0A);
 
+#if !TASK_SIM
+  // The scheduler leaves the stack of main() for good. Reclaim its top 0x100
+  // bytes, unless tasks created before now sit right below them.
+  if (_task__heap_end == TASK_HEAP_END) {
+    _task__heap_end = TASK_HEAP_END_STARTED;
+  }
+#endif
+
   // Schedule next task to run.
+#if TASK_SIM
+  task__scheduler();
+#else
   task__jmp_scheduler();
+#endif
 }
 
+#if TASK_SIM
+// Yield execution to any other schedulable task.
+void task_yield(void) {
+  task__switch();
+}
+#else
 // Yield execution to any other schedulable task.
+// This is a regular function call, so only the call-saved registers have to
+// be preserved. It pushes a cooperative frame instead of a full frame.
 void task_yield(void) __attribute__((naked));
 void task_yield(void) {
-  task__push();
+  asm volatile(
+    // Save status register
+    "in r0, 0x3f\n"
+    "cli\n"
+    "push r0\n"
+
+    // Save call-saved registers
+    "push r2\n"
+    "push r3\n"
+    "push r4\n"
+    "push r5\n"
+    "push r6\n"
+    "push r7\n"
+    "push r8\n"
+    "push r9\n"
+    "push r10\n"
+    "push r11\n"
+    "push r12\n"
+    "push r13\n"
+    "push r14\n"
+    "push r15\n"
+    "push r16\n"
+    "push r17\n"
+    "push r28\n"
+    "push r29\n"
+
+    // Mark frame as cooperative frame
+    "ldi r24, %0\n"
+    "push r24\n"
+
+    // Save stack pointer in current task struct
+    "lds r30, _task__current\n" // Low
+    "lds r31, _task__current+1\n" // High
+    "in r0, 0x3d\n" // Low
+    "st z+, r0\n"
+    "in r0, 0x3e\n" // High
+    "st z+, r0\n"
+
+    :: "M" (TASK_FRAME_COOPERATIVE)
+  );
 
   task__jmp_scheduler();
 }
+#endif // TASK_SIM
+
+#if TASK_STATS
+// Take snapshot of task statistics.
+void task_stats(task_t *t, task_stats_t *stats) {
+  uint8_t sreg = SREG;
+
+  cli();
+  if (t) {
+    *stats = t->stats;
+  } else {
+    stats->run_counts = _task__idle;
+    stats->scheduled = 0;
+    stats->preempted = 0;
+    stats->yielded = 0;
+  }
+  SREG = sreg;
+}
+#endif // TASK_STATS
 
 // Return pointer to current task.
 task_t *task_current(void) {
@@ -538,9 +1531,8 @@ void task__suspend(QUEUE *h) {
 
   cli();
 
-  QUEUE *q = &_task__current->member;
-  QUEUE_REMOVE(q);
-  QUEUE_INSERT_TAIL(h, q);
+  task__unready();
+  QUEUE_INSERT_TAIL(h, &_task__current->member);
 
   task_yield();
 
@@ -556,21 +1548,547 @@ void task_suspend(QUEUE *h) {
   task__suspend(h);
 }
 
+// Have task_yield_pending switch to the woken up task if it has a higher
+// priority than the current one.
+// Must be called with interrupts disabled.
+static void task__yield_later(task_t *t) {
+  if (_task__current && t->prio > _task__current->prio) {
+    _task__yield_pending = 1;
+  }
+}
+
+// Preempt the current task if the woken up task has a higher priority.
+// Only switches right away if interrupts were enabled before the caller
+// disabled them (sreg). Otherwise the caller is an interrupt handler or a
+// critical section, which must not be split, so the switch is left to
+// task_yield_pending or the next tick.
+// Must be called with interrupts disabled.
+static void task__preempt(task_t *t, uint8_t sreg) {
+  if (!(sreg & _BV(SREG_I))) {
+    task__yield_later(t);
+    return;
+  }
+
+  if (_task__current && t->prio > _task__current->prio) {
+#if TASK_STATS
+    _task__preempting = 1;
+#endif
+    task_yield();
+  }
+}
+
+// Preempt the interrupted task if the woken up task has the same or a higher
+// priority. The woken up task is moved to the head of its runnable queue so
+// that it is scheduled next. The interrupted task resumes from the end of the
+// interrupt handler once it is scheduled again.
+static void task__preempt_from_isr(task_t *t) {
+  if (_task__current && t->prio >= _task__current->prio) {
+    QUEUE_REMOVE(&t->member);
+    QUEUE_INSERT_HEAD(&_tasks__runnable[t->prio], &t->member);
+#if TASK_STATS
+    _task__preempting = 1;
+#endif
+    task_yield();
+  }
+}
+
 // Wake up task.
 void task_wakeup(task_t *t) {
   uint8_t sreg = SREG;
 
   cli();
 
-  QUEUE *q = &t->member;
+  t->woken = 1;
+  task__wakeup(t);
+  task__preempt(t, sreg);
+
+  SREG = sreg;
+}
+
+// Wake up task from an interrupt handler.
+// Must be the last thing the interrupt handler does.
+void task_wakeup_from_isr(task_t *t) {
+  t->woken = 1;
+  task__wakeup(t);
+  task__preempt_from_isr(t);
+}
+
+// Wake up task without switching to it.
+void task_wakeup_pending(task_t *t) {
+  uint8_t sreg = SREG;
+
+  cli();
+
+  t->woken = 1;
+  task__wakeup(t);
+  task__yield_later(t);
+
+  SREG = sreg;
+}
+
+// Switch to the task woken up by task_wakeup_pending, if any.
+void task_yield_pending(void) {
+  uint8_t sreg = SREG;
+
+  cli();
+
+  if (_task__yield_pending) {
+#if TASK_STATS
+    _task__preempting = 1;
+#endif
+    task_yield();
+  }
+
+  SREG = sreg;
+}
+
+// Wait on queue until woken up or until the timeout expires.
+uint8_t task_wait(QUEUE *q, uint16_t timeout_ms) {
+  uint8_t sreg = SREG;
+  task_t *t;
+
+  cli();
+
+  t = _task__current;
+  t->woken = 0;
+  QUEUE_INSERT_TAIL(q, &t->wait);
+
+  // The task is on the wait queue and on either the sleeping queue or the
+  // suspended queue at the same time. Whichever wakes it up first removes it
+  // from the other (see task__wakeup).
+  if (timeout_ms) {
+    task__sleep(timeout_ms / MS_PER_TICK);
+  } else {
+    task__unready();
+    QUEUE_INSERT_TAIL(&_tasks__suspended, &t->member);
+  }
+
+  task_yield();
+
+  SREG = sreg;
+
+  return t->woken;
+}
+
+// Wake up the task at the head of a wait queue, if any.
+// Must be called with interrupts disabled.
+static task_t *task__wake_one(QUEUE *q) {
+  task_t *t;
+
+  if (QUEUE_EMPTY(q)) {
+    return 0;
+  }
+
+  t = QUEUE_DATA(QUEUE_HEAD(q), task_t, wait);
+  t->woken = 1;
+  task__wakeup(t);
+
+  return t;
+}
+
+// Wake up the task that has been waiting the longest.
+task_t *task_wake_one(QUEUE *q) {
+  uint8_t sreg = SREG;
+  task_t *t;
+
+  cli();
+
+  t = task__wake_one(q);
+  if (t) {
+    task__preempt(t, sreg);
+  }
+
+  SREG = sreg;
+
+  return t;
+}
+
+// Wake up the task that has been waiting the longest from an interrupt
+// handler. Must be the last thing the interrupt handler does.
+task_t *task_wake_one_from_isr(QUEUE *q) {
+  task_t *t = task__wake_one(q);
+
+  if (t) {
+    task__preempt_from_isr(t);
+  }
+
+  return t;
+}
+
+// Wake up all tasks waiting on queue.
+uint8_t task_wake_all(QUEUE *q) {
+  uint8_t sreg = SREG;
+  task_t *max = 0;
+  task_t *t;
+  uint8_t n = 0;
+
+  cli();
+
+  while ((t = task__wake_one(q)) != 0) {
+    if (max == 0 || t->prio > max->prio) {
+      max = t;
+    }
+    n++;
+  }
+
+  // Preempt once, for the task with the highest priority.
+  if (max) {
+    task__preempt(max, sreg);
+  }
+
+  SREG = sreg;
+
+  return n;
+}
+
+// Change priority of task.
+// A runnable task is moved to the runnable queue for its new priority.
+// Must be called with interrupts disabled.
+static void task__set_prio(task_t *t, uint8_t prio) {
+  QUEUE *h = &_tasks__runnable[t->prio];
+  QUEUE *q;
+
+  QUEUE_FOREACH(q, h) {
+    if (q == &t->member) {
+      break;
+    }
+  }
+
+  if (q == h) {
+    // Not runnable; picked up by task__ready when it is woken up.
+    t->prio = prio;
+    return;
+  }
+
   QUEUE_REMOVE(q);
-  QUEUE_INSERT_TAIL(&_tasks__runnable, q);
+  if (QUEUE_EMPTY(h)) {
+    _tasks__ready &= ~_BV(t->prio);
+  }
+
+  t->prio = prio;
+  task__ready(t);
+}
+
+// Initialize unlocked mutex.
+void task_mutex_init(task_mutex_t *m) {
+  m->owner = 0;
+  QUEUE_INIT(&m->waiters);
+}
+
+// Lock mutex, waiting for it if it is held by another task.
+void task_mutex_lock(task_mutex_t *m) {
+  uint8_t sreg = SREG;
+  task_t *t;
+
+  cli();
+
+  t = _task__current;
+
+  // The mutex is handed to this task when its owner unlocks it.
+  while (m->owner != t) {
+    if (m->owner == 0) {
+      m->owner = t;
+      t->locks++;
+      break;
+    }
+
+    // Lend priority to the owner for as long as it holds the mutex.
+    if (m->owner->prio < t->prio) {
+      task__set_prio(m->owner, t->prio);
+    }
+
+    task_wait(&m->waiters, 0);
+  }
+
+  SREG = sreg;
+}
+
+// Lock mutex if it is not held by another task.
+uint8_t task_mutex_trylock(task_mutex_t *m) {
+  uint8_t sreg = SREG;
+  uint8_t locked = 0;
+
+  cli();
+
+  if (m->owner == 0) {
+    m->owner = _task__current;
+    m->owner->locks++;
+    locked = 1;
+  }
+
+  SREG = sreg;
+
+  return locked;
+}
+
+// Unlock mutex held by the current task.
+void task_mutex_unlock(task_mutex_t *m) {
+  uint8_t sreg = SREG;
+  task_t *t = 0;
+  task_t *w;
+  QUEUE *q;
+
+  cli();
+
+  // Find the waiting task with the highest priority.
+  // Tasks with equal priorities get the mutex in the order they waited.
+  QUEUE_FOREACH(q, &m->waiters) {
+    w = QUEUE_DATA(q, task_t, wait);
+    if (t == 0 || w->prio > t->prio) {
+      t = w;
+    }
+  }
+
+  m->owner = t;
+  if (t) {
+    t->locks++;
+    t->woken = 1;
+    task__wakeup(t);
+  }
+
+  // Return to the base priority once no mutex is held, where another task may
+  // have to lend its priority again.
+  w = _task__current;
+  if (--w->locks == 0 && w->prio != w->base_prio) {
+    task__set_prio(w, w->base_prio);
+  }
+
+  // Yield to the new owner, or to any task that was held off by this task's
+  // raised priority.
+  if (_tasks__ready >> (w->prio + 1)) {
+#if TASK_STATS
+    _task__preempting = 1;
+#endif
+    task_yield();
+  }
 
   SREG = sreg;
 }
 
+// Post message to mailbox.
+uint8_t task_mbox_post(task_mbox_t *mb, const void *msg) {
+  uint8_t sreg = SREG;
+  task_t *t;
+  uint8_t i;
+
+  cli();
+
+  if (mb->count == mb->capacity) {
+    SREG = sreg;
+    return 0;
+  }
+
+  i = mb->head + mb->count;
+  if (i >= mb->capacity) {
+    i -= mb->capacity;
+  }
+
+  memcpy(mb->buf + (i * mb->size), msg, mb->size);
+  mb->count++;
+  t = task__wake_one(&mb->receivers);
+  if (t) {
+    task__yield_later(t);
+  }
+
+  SREG = sreg;
+
+  // Switch to the receiver only if interrupts were enabled, so never in the
+  // middle of an interrupt handler.
+  if (sreg & _BV(SREG_I)) {
+    task_yield_pending();
+  }
+
+  return 1;
+}
+
+// Take the oldest message out of a mailbox that isn't empty.
+// Must be called with interrupts disabled.
+static void task__mbox_take(task_mbox_t *mb, void *msg) {
+  memcpy(msg, mb->buf + (mb->head * mb->size), mb->size);
+  mb->count--;
+  mb->head++;
+  if (mb->head == mb->capacity) {
+    mb->head = 0;
+  }
+}
+
+// Receive message from mailbox, waiting at most timeout_ms for it.
+uint8_t task_mbox_receive_timeout(task_mbox_t *mb, void *msg, uint16_t timeout_ms) {
+  uint8_t sreg = SREG;
+
+  cli();
+
+  // Another receiver may take the message before this task runs again.
+  while (mb->count == 0) {
+    if (!task_wait(&mb->receivers, timeout_ms)) {
+      SREG = sreg;
+      return 0;
+    }
+  }
+
+  task__mbox_take(mb, msg);
+
+  SREG = sreg;
+
+  return 1;
+}
+
+// Receive message from mailbox if there is one.
+uint8_t task_mbox_try_receive(task_mbox_t *mb, void *msg) {
+  uint8_t sreg = SREG;
+  uint8_t received = 0;
+
+  cli();
+
+  if (mb->count) {
+    task__mbox_take(mb, msg);
+    received = 1;
+  }
+
+  SREG = sreg;
+
+  return received;
+}
+
+// Receive message from mailbox, waiting for it if there is none.
+void task_mbox_receive(task_mbox_t *mb, void *msg) {
+  task_mbox_receive_timeout(mb, msg, 0);
+}
+
 // Make current task sleep for specified number of ticks.
 void task_sleep(uint16_t ms) {
-  _task__current->delay = ms / MS_PER_TICK;
-  task__suspend(&_tasks__sleeping);
+  uint8_t sreg = SREG;
+
+  cli();
+  task__sleep(ms / MS_PER_TICK);
+  task_yield();
+
+  SREG = sreg;
 }
+
+// Make current task sleep until the specified tick.
+uint16_t task_sleep_until(uint32_t deadline) {
+  uint8_t sreg = SREG;
+  int32_t delta;
+  uint32_t late;
+
+  cli();
+
+  // Sleep in multiple steps if the deadline is out of reach of a single sleep.
+  // Also keep sleeping if the task was woken up early.
+  for (;;) {
+    delta = deadline - _task__ticks;
+    if (delta <= 0) {
+      break;
+    }
+
+    task__sleep((delta > UINT16_MAX) ? UINT16_MAX : delta);
+    task_yield();
+  }
+
+  // Time between the deadline and now.
+  late = ((uint32_t)-delta * US_PER_TICK) + (TCNT0 * US_PER_COUNT);
+
+  SREG = sreg;
+
+  return (late > UINT16_MAX) ? UINT16_MAX : late;
+}
+
+// Set compare B to the target count of the first task in task_usleep.
+// The interrupt fires at that count on every tick until the task is due, so
+// a count that has already passed in the current tick only costs an extra
+// interrupt.
+// Must be called with interrupts disabled, with the list not empty.
+static void task__usleep_arm(uint32_t now) {
+  struct task__usleeper *u =
+    QUEUE_DATA(QUEUE_HEAD(&_tasks__usleeping), struct task__usleeper, member);
+
+  OCR0B = (now + (int16_t)(u->target - (uint16_t)now)) % COUNTS_PER_TICK;
+}
+
+// Make current task sleep for specified number of microseconds.
+void task_usleep(uint16_t us) {
+  uint8_t sreg = SREG;
+  struct task__usleeper u;
+  struct task__usleeper *v;
+  uint32_t now;
+  QUEUE *q;
+
+  cli();
+
+  // Timer count at which to wake up. A match sets the flag as the timer
+  // moves on from the compare value, so the wait ends between target - now
+  // and one count later. Round up to whole counts.
+  now = task__counts();
+  u.target = now + ((us + US_PER_COUNT - 1) / US_PER_COUNT);
+  u.task = _task__current;
+
+  // Clear stale match and enable interrupt if nobody else is waiting.
+  if (QUEUE_EMPTY(&_tasks__usleeping)) {
+    TIFR0 = _BV(OCF0B);
+    TIMSK0 |= _BV(OCIE0B);
+  }
+
+  // Tasks with equal targets are woken up in the order they went to sleep.
+  QUEUE_FOREACH(q, &_tasks__usleeping) {
+    v = QUEUE_DATA(q, struct task__usleeper, member);
+    if ((int16_t)(u.target - v->target) < 0) {
+      break;
+    }
+  }
+
+  // Insert before q (or at the tail if the loop ran to completion).
+  QUEUE_INSERT_TAIL(q, &u.member);
+  if (QUEUE_HEAD(&_tasks__usleeping) == &u.member) {
+    task__usleep_arm(now);
+  }
+
+  task__unready();
+  QUEUE_INSERT_TAIL(&_tasks__suspended, &_task__current->member);
+  task_yield();
+
+  // Woken up by something else than the interrupt.
+  if (!QUEUE_EMPTY(&u.member)) {
+    QUEUE_REMOVE(&u.member);
+  }
+
+  SREG = sreg;
+}
+
+// Wake up tasks sleeping in task_usleep whose target has passed.
+ISR(TIMER0_COMPB_vect) {
+  uint32_t now = task__counts();
+  struct task__usleeper *u;
+  task_t *max = 0;
+
+  while (!QUEUE_EMPTY(&_tasks__usleeping)) {
+    u = QUEUE_DATA(QUEUE_HEAD(&_tasks__usleeping), struct task__usleeper, member);
+    if ((int16_t)(u->target - (uint16_t)now) > 0) {
+      break;
+    }
+
+    QUEUE_REMOVE(&u->member);
+    QUEUE_INIT(&u->member);
+    u->task->woken = 1;
+    task__wakeup(u->task);
+    if (max == 0 || u->task->prio > max->prio) {
+      max = u->task;
+    }
+  }
+
+  if (QUEUE_EMPTY(&_tasks__usleeping)) {
+    TIMSK0 &= ~_BV(OCIE0B);
+  } else {
+    task__usleep_arm(now);
+  }
+
+  if (max) {
+    task__preempt_from_isr(max);
+  }
+}
+
+#if TASK_SLEEP_ADC
+void task_sleep_adc(uint8_t on) {
+  _task__adc_sleep = on;
+}
+#endif
@@ -2,6 +2,7 @@
 #define _TASK_H
 
 #include <stdint.h>
+#include <util/delay_basic.h>
 
 #include "queue.h"
 
@@ -17,31 +18,133 @@
 // Clock select: prescaler = 1/256
 #define _TCCR0B (_BV(CS02))
 #define COUNTS_PER_TICK ((F_CPU / 256) / (1000 / MS_PER_TICK))
+// Clock select when idle in tickless mode: prescaler = 1/1024
+#define _TCCR0B_TICKLESS (_BV(CS02) | _BV(CS00))
+#define TICKLESS_RATIO 4
 #elif F_CPU == 8000000L
 // Clock select: prescaler = 1/64
 #define _TCCR0B (_BV(CS01) | _BV(CS00))
 #define COUNTS_PER_TICK ((F_CPU / 64) / (1000 / MS_PER_TICK))
+// Clock select when idle in tickless mode: prescaler = 1/1024
+#define _TCCR0B_TICKLESS (_BV(CS02) | _BV(CS00))
+#define TICKLESS_RATIO 16
 #else
 #error "Unsupported F_CPU"
 #endif
 
+// Number of priority levels (at most 8).
+// Tasks with a higher priority level are always scheduled first.
+#ifndef TASK_PRIO_COUNT
+#define TASK_PRIO_COUNT 4
+#endif
+
+#if TASK_PRIO_COUNT > 8
+#error "TASK_PRIO_COUNT must not exceed 8"
+#endif
+
+// Priority level for tasks created with task_create.
+#define TASK_PRIO_DEFAULT 1
+
+// Stack size for tasks created without an explicit stack size.
+#ifndef TASK_STACK_SIZE
+#define TASK_STACK_SIZE 0xf0
+#endif
+
+// Stack size for the scheduler and interrupt handlers that run while idle.
+#ifndef TASK_SCHEDULER_STACK_SIZE
+#define TASK_SCHEDULER_STACK_SIZE 0x100
+#endif
+
+// Unused stack bytes hold TASK_STACK_PAINT.
+// The lowest stack byte holds TASK_STACK_CANARY.
+#define TASK_STACK_PAINT 0xa5
+#define TASK_STACK_CANARY 0x5a
+
 typedef void (*task_fn)(void *);
 
+// Only keep scheduler statistics if specified
+#if TASK_STATS
+typedef struct task_stats_s task_stats_t;
+
+struct task_stats_s {
+  uint32_t run_counts; // Timer counts (US_PER_COUNT each) spent running.
+  uint16_t scheduled; // Times the task was scheduled.
+  uint16_t preempted; // Times the task was switched out involuntarily.
+  uint16_t yielded; // Times the task yielded, slept, or suspended itself.
+};
+#endif
+
 typedef struct task_s task_t;
 
 struct task_s {
   void *sp; // Stack pointer this task can be resumed from.
-  uint16_t delay; // Ticks until task can be scheduled again.
+  uint16_t delay; // Ticks after previous sleeping task until wakeup.
+  uint8_t prio; // Priority level (raised while holding a contended mutex).
+  uint8_t base_prio; // Priority level the task was created with.
+  uint8_t locks; // Number of mutexes held.
+  uint8_t *stack; // Lowest address of stack.
+  uint16_t stack_size; // Stack size in bytes.
+
+#if TASK_STATS
+  task_stats_t stats;
+#endif
 
   QUEUE member;
+
+  QUEUE wait; // Member of wait queue (see task_wait).
+  uint8_t woken; // Set if task was woken up explicitly.
 };
 
 // Initialize internal structures, tick timer, etc.
 void task_init(void);
 
+// Startup code runs functions in .init8 before main(); the simulator uses
+// constructors instead.
+#if TASK_SIM
+#define TASK__INIT_ATTRIBUTES __attribute__((constructor))
+#else
+#define TASK__INIT_ATTRIBUTES __attribute__((naked, used, section(".init8")))
+#endif
+
+// Declare task that is allocated at link time.
+// Emits the task struct (in .bss) and its stack (in .noinit), and builds the
+// task's initial frame at startup, before main() runs. The task becomes
+// runnable when task_init is called.
+#define TASK_DEFINE(name, fn, data, stack_size, prio)                         \
+  static uint8_t name##__stack[stack_size]                                    \
+    __attribute__((section(".noinit")));                                      \
+  task_t name;                                                                \
+  static void name##__init(void) TASK__INIT_ATTRIBUTES;                       \
+  static void name##__init(void) {                                            \
+    task__static_create(                                                      \
+      &name, name##__stack, sizeof(name##__stack), (fn), (data), (prio));     \
+  }
+
+// Internal, used by TASK_DEFINE.
+void task__static_create(task_t *t, uint8_t *stack, uint16_t stack_size, task_fn fn, void *data, uint8_t prio);
+
 // Creates a task for the specified function.
 task_t *task_create(task_fn fn, void *data);
 
+// Creates a task for the specified function with the specified priority.
+// Returns NULL if prio is not below TASK_PRIO_COUNT or if there is not enough
+// memory left.
+task_t *task_create_prio(task_fn fn, void *data, uint8_t prio);
+
+// Creates a task for the specified function with the specified stack size.
+// Returns NULL if there is not enough memory left.
+task_t *task_create_ex(task_fn fn, void *data, uint16_t stack_size);
+
+// Return number of stack bytes the task has never used.
+uint16_t task_stack_free(task_t *t);
+
+// Return high-water mark of stack usage in bytes.
+uint16_t task_stack_used(task_t *t);
+
+// Called when a task overflowed its stack. Never returns.
+// The default handler halts the processor; it can be overridden.
+void task_stack_overflow(task_t *t);
+
 // Starts task execution. Never returns.
 void task_start(void);
 
@@ -51,17 +154,240 @@ void task_yield(void);
 // Return pointer to current task.
 task_t *task_current(void);
 
+#if TASK_STATS
+// Take snapshot of statistics for specified task.
+// If t is NULL, run_counts holds the timer counts spent idle. Divide by
+// (task_now() * COUNTS_PER_TICK) for the idle fraction. Counters wrap.
+void task_stats(task_t *t, task_stats_t *stats);
+#endif
+
 // Suspend task until it is woken up explicitly.
 // The task is added to the tail of the queue pointed to by q. If q is NULL,
 // it is added to the system wide queue for suspended tasks.
 void task_suspend(QUEUE *h);
 
 // Wake up task.
+// Preempts the current task if the woken up task has a higher priority.
+// Called with interrupts disabled, from an interrupt handler or a critical
+// section, it doesn't switch tasks there, but leaves the switch to
+// task_yield_pending or the next tick, like task_wakeup_pending.
 void task_wakeup(task_t *t);
 
+// Wake up task from an interrupt handler.
+// Switches to the woken up task on return from the interrupt handler if it has
+// the same or a higher priority than the interrupted task, instead of waiting
+// for the next tick. Must be the last thing the interrupt handler does.
+void task_wakeup_from_isr(task_t *t);
+
+// Wake up task without switching to it.
+// May be called from anywhere in an interrupt handler. If the woken up task
+// has a higher priority than the interrupted one, it runs once the handler
+// calls task_yield_pending, or at the next tick.
+void task_wakeup_pending(task_t *t);
+
+// Switch to a task woken up by task_wakeup_pending if it has a higher priority
+// than the current task. From an interrupt handler, it must be the last thing
+// the handler does.
+void task_yield_pending(void);
+
+// Wait on a queue until woken up by task_wake_one/task_wake_all, or until the
+// timeout expires. A timeout of 0 means waiting without timeout.
+// Returns 1 if woken up, 0 on timeout.
+uint8_t task_wait(QUEUE *q, uint16_t timeout_ms);
+
+// Wake up the task that has been waiting on the queue the longest.
+// Switches tasks like task_wakeup.
+// Returns the task that was woken up, or NULL if the queue was empty.
+task_t *task_wake_one(QUEUE *q);
+
+// Like task_wake_one, but with the semantics of task_wakeup_from_isr.
+task_t *task_wake_one_from_isr(QUEUE *q);
+
+// Wake up all tasks waiting on the queue.
+// Switches tasks like task_wakeup, once, for the highest priority.
+// Returns the number of tasks that were woken up.
+uint8_t task_wake_all(QUEUE *q);
+
+// Mailbox holding up to a fixed number of fixed-size messages.
+// Messages are copied in and out, and received in the order they were posted.
+typedef struct task_mbox_s task_mbox_t;
+
+struct task_mbox_s {
+  uint8_t *buf; // Storage for capacity messages.
+  uint8_t size; // Message size in bytes.
+  uint8_t capacity; // Maximum number of messages.
+  uint8_t head; // Index of oldest message.
+  uint8_t count; // Number of messages.
+
+  QUEUE receivers; // Tasks waiting for a message.
+};
+
+// Define mailbox for up to n messages of the specified type.
+#define TASK_MBOX_DEFINE(name, type, n)                                       \
+  static uint8_t name##__buf[sizeof(type) * (n)];                             \
+  task_mbox_t name = {                                                        \
+    .buf = name##__buf,                                                       \
+    .size = sizeof(type),                                                     \
+    .capacity = (n),                                                          \
+    .receivers = { &name.receivers, &name.receivers },                        \
+  }
+
+// Post message to mailbox. May be called from interrupt handlers, but doesn't
+// switch to the receiver there (see task_wakeup_pending).
+// Returns 0 if the mailbox is full.
+uint8_t task_mbox_post(task_mbox_t *mb, const void *msg);
+
+// Receive message from mailbox, waiting for it if there is none.
+void task_mbox_receive(task_mbox_t *mb, void *msg);
+
+// Receive message from mailbox, waiting at most timeout_ms for it.
+// Returns 1 if a message was received, 0 on timeout.
+uint8_t task_mbox_receive_timeout(task_mbox_t *mb, void *msg, uint16_t timeout_ms);
+
+// Receive message from mailbox without waiting.
+// Returns 1 if a message was received, 0 if the mailbox was empty.
+uint8_t task_mbox_try_receive(task_mbox_t *mb, void *msg);
+
+// Mutex that suspends tasks waiting for it, instead of disabling interrupts
+// for the duration of the critical section.
+//
+// A task waiting for a mutex lends its priority to the owner, so that a low
+// priority owner can't be held off indefinitely by tasks of medium priority.
+// The owner returns to its own priority when it releases the last mutex it
+// holds. Inheritance is not transitive: if the owner itself waits for another
+// mutex, that mutex's owner is not boosted.
+//
+// Mutexes are not recursive and must not be used from interrupt handlers.
+typedef struct task_mutex_s task_mutex_t;
+
+struct task_mutex_s {
+  task_t *owner; // Task holding the mutex, if any.
+
+  QUEUE waiters; // Tasks waiting for the mutex.
+};
+
+// Define unlocked mutex.
+#define TASK_MUTEX_DEFINE(name)                                               \
+  task_mutex_t name = {                                                       \
+    .owner = 0,                                                               \
+    .waiters = { &name.waiters, &name.waiters },                              \
+  }
+
+// Initialize unlocked mutex.
+void task_mutex_init(task_mutex_t *m);
+
+// Lock mutex, waiting for it if it is held by another task.
+void task_mutex_lock(task_mutex_t *m);
+
+// Lock mutex if it is not held by another task.
+// Returns 1 if the mutex was locked, 0 otherwise.
+uint8_t task_mutex_trylock(task_mutex_t *m);
+
+// Unlock mutex held by the current task.
+// Hands the mutex to the waiting task with the highest priority, if any.
+void task_mutex_unlock(task_mutex_t *m);
+
 // Sleep current task for specified number of milliseconds.
 void task_sleep(uint16_t ms);
 
+// Convert milliseconds to ticks.
+#define TASK_MSEC_TO_TICKS(ms) ((ms) / MS_PER_TICK)
+
+// Return number of ticks since task_init.
+// This 32-bit clock is monotonic and only wraps after more than 99 days.
+uint32_t task_now(void);
+
+// Sleep current task until task_now() reaches the specified deadline.
+// Periodic tasks should advance their deadline by their period, instead of
+// computing it relative to the time they wake up, to run without drift.
+// Returns the scheduling jitter: the number of microseconds that passed
+// between the deadline and the task resuming (saturates at UINT16_MAX).
+uint16_t task_sleep_until(uint32_t deadline);
+
+// Skip ticks while idle if specified.
+// When no task is runnable, the scheduler stretches the timer period up to
+// the deadline of the first sleeping task before going to sleep. TIMER0 is an
+// 8-bit timer, so a stretched period covers at most a few ticks. The clocks
+// below are caught up when a task becomes runnable or the period ends.
+// The period is only stretched if the first sleeping task is at least
+// TICKLESS_RATIO ticks away and no task_usleep is pending, so it saves
+// nothing while some task wakes up on every tick.
+// Uses Timer1, running freely at F_CPU/8, to measure the time spent in the
+// stretched period.
+#if TASK_TICKLESS
+#define TICKLESS_MAX_PERIODS ((UINT8_MAX + 1) / COUNTS_PER_TICK)
+#endif
+
+// Sleep current task for specified number of microseconds.
+// Uses the TIMER0 compare B interrupt, so the wait is rounded up to the timer
+// resolution (US_PER_COUNT) instead of to the next tick. Any number of tasks
+// can wait at the same time; the interrupt fires for the first one due.
+void task_usleep(uint16_t us);
+
+// Waits shorter than this number of microseconds are busy waits.
+// Sleeping for them would take longer than the wait itself.
+#ifndef TASK_BUSY_USEC
+#define TASK_BUSY_USEC 20
+#endif
+
+// Wait for specified number of microseconds.
+// Short waits are busy waits, longer waits sleep the current task.
+static inline void task_sleep_us(uint16_t us) __attribute__((always_inline));
+static inline void task_sleep_us(uint16_t us) {
+  if (us >= TASK_BUSY_USEC) {
+    task_usleep(us);
+  } else if (us > 0) {
+    // Busy loop takes 4 cycles per iteration.
+    _delay_loop_2(us * (F_CPU / 4000000));
+  }
+}
+
+// Only run deferred work if specified
+// Interrupt handlers post work items (function pointer and argument) to a
+// ring buffer with task_defer. A worker task at the highest priority level
+// runs them with interrupts enabled. Returns 0 if the ring buffer is full.
+// May be called from interrupt handlers, or from tasks with interrupts
+// disabled (there can only be one producer at a time). An interrupt handler
+// doesn't switch to the worker; it runs once the handler ends with
+// task_yield_pending, or at the next tick.
+#if TASK_DEFER
+#ifndef TASK_DEFER_SIZE
+#define TASK_DEFER_SIZE 8
+#endif
+#ifndef TASK_DEFER_STACK_SIZE
+#define TASK_DEFER_STACK_SIZE 0x80
+#endif
+typedef void (*task_work_fn)(void *);
+typedef struct {
+  task_work_fn fn;
+  void *arg;
+} task_work_t;
+uint8_t task_defer(task_work_fn fn, void *arg);
+#endif
+
+// Only run protothreads (see pt.h) if specified
+#if TASK_PT
+#ifndef TASK_PT_STACK_SIZE
+#define TASK_PT_STACK_SIZE 0x80
+#endif
+// Longest time between polls of a waiting protothread (see task_pt_poll).
+#ifndef TASK_PT_POLL_MS
+#define TASK_PT_POLL_MS 20
+#endif
+#endif
+
+// Only sleep in ADC Noise Reduction mode if specified
+// With a non-zero argument, the scheduler puts the processor in ADC Noise
+// Reduction mode instead of Idle mode when no task is runnable. Entering it
+// starts an ADC conversion, and the CPU and the I/O clock stop until the
+// conversion complete interrupt wakes it up. TIMER0 and Timer1 stop with the
+// I/O clock, so Timer4 is run off the PLL to measure how long each sleep took,
+// and the difference is added to the clocks. Pass 0 to go back to Idle mode.
+// May be called from interrupt handlers.
+#if TASK_SLEEP_ADC
+void task_sleep_adc(uint8_t on);
+#endif
+
 // Only count seconds if specified
 #if TASK_COUNT_SEC
 #ifndef TASK_SEC_T